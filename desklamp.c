@@ -10,16 +10,68 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
+#include <avr/wdt.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <util/atomic.h>
+#include <string.h>
 #include "desklamp.h"
 #include "entropy.h"
-
-#define SERIAL_EEPROM_STORE		0
-#define COLORMODE_EEPROM_STORE	4
-#define ADAPTER_EEPROM_STORE	5
+#include "sequence.h"
+#include "vm.h"
+#include "macro.h"
+#include "effect.h"
+#include "lfo.h"
+#include "diag.h"
 
 static desklamp_t desklamp;
+#if FADE == 1
+static desklamp_fade_t fade;
+#endif
+#if SCENE_COUNT > 0
+static desklamp_scene_t scenes[SCENE_COUNT];		// cache of SCENE_EEPROM_STORE
+#endif
+#if POWERON == 1
+static uint8_t poweron_mode;
+static uint8_t poweron_look[4];							// r, g, b, dimmer waiting to be saved
+static uint16_t poweron_delay;							// ticks until poweron_look is saved
+#endif
+#if FAILSAFE == 1
+static desklamp_failsafe_t failsafe;
+static uint8_t host_active;								// SET report received since last failsafe
+static uint16_t host_idle;								// ticks since last SET report
+static uint16_t host_timeout;							// failsafe.timeout in ticks
+#endif
+#if STROBE == 1
+static volatile uint32_t strobe_inc;					// phase increment per tick, 0 = strobe off
+static volatile uint32_t strobe_phase;
+#endif
+#if STROBE_BEAT == 1
+static volatile int32_t strobe_error;						// phase correction posted by desklamp_strobe_beat()
+static volatile uint8_t strobe_adjust;					// 1 = strobe_error not yet applied by the timer
+static uint16_t beat_ticks;								// ticks since last beat
+static uint16_t beat_bpm;								// tempo of last beat (0.01 BPM)
+static uint8_t beat_sub;								// flashes per beat of last beat
+static int32_t beat_trim;								// PLL frequency correction
+#endif
+#if STROBE == 1
+static volatile uint8_t strobe_flash;					// 1 = flash is on
+static volatile uint16_t strobe_width;					// flash width (ticks)
+static uint16_t strobe_remain;							// ticks until flash off
+static uint16_t strobe_ms;								// flash width (ms), 0 = one tick
+static uint8_t strobe_duty;								// flash width (% of period), 0 = use strobe_ms
+static uint8_t strobe_intensity;						// flash intensity
+static volatile uint8_t strobe_on0;						// COM bits of TCCR0A during flash
+static volatile uint8_t strobe_on1;						// COM bits of TCCR1A during flash
+#endif
+#if RESET_LOG == 1
+static uint8_t reset_cause __attribute__ ((section (".noinit")));	// MCUSR at boot
+#endif
+static volatile uint8_t ticks;
+#if DIAGNOSTICS == 1
+static volatile uint8_t overflows;						// high byte of desklamp_get_time()
+#endif
+static volatile uint8_t extusb_debounce;				// ticks until ext USB pins are read, 0 = no change
 
 
 /** brightness table */
@@ -44,6 +96,151 @@ const PROGMEM uint8_t pwmtable[128] = {
 		255
 };
 
+#if STROBE == 1
+/** strobe period (ticks) of the legacy 8 bit strobe value */
+const PROGMEM uint8_t strobetable[256] = {
+		  0, 164, 149, 136, 125, 116, 108, 101,  95,  90,  85,  81,  77,  73,  70,  67,
+	 	 64,  62,  60,  57,  55,  54,  52,  50,  49,  47,  46,  44,  43,  42,  41,  40,
+		 39,  38,  37,  36,  35,  35,  34,  33,  32,  32,  31,  31,  30,  29,  29,  28,
+		 28, 27, 27, 26, 26, 26, 25, 25, 24, 24, 24, 23, 23, 23, 22, 22,
+		 22, 21, 21, 21, 20, 20, 20, 20, 19, 19, 19, 19, 18, 18, 18, 18,
+		 18, 17, 17, 17, 17, 17, 16, 16, 16, 16, 16, 16, 15, 15, 15, 15,
+		 15, 15, 15, 14, 14, 14, 14, 14, 14, 14, 14, 13, 13, 13, 13, 13,
+		 13, 13, 13, 13, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 11, 11,
+		 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 10, 10, 10, 10, 10, 10,
+		 10, 10, 10, 10, 10, 10, 10, 10, 10,  9,  9,  9,  9,  9,  9,  9,
+		 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 8, 8, 8, 8,
+		 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+		 8, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+		 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 6, 6,
+		 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+		 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6
+};
+#endif
+
+#if CCT == 1
+/** color temperature table, CCT_MIN_KELVIN + n * 512 K */
+const PROGMEM uint8_t ccttable[23][3] = {
+		{255,  68,   0},	//  1000 K
+		{255, 109,   0},	//  1512 K
+		{255, 138,  17},	//  2024 K
+		{255, 160,  73},	//  2536 K
+		{255, 179, 113},	//  3048 K
+		{255, 194, 144},	//  3560 K
+		{255, 208, 169},	//  4072 K
+		{255, 219, 191},	//  4584 K
+		{255, 230, 209},	//  5096 K
+		{255, 239, 226},	//  5608 K
+		{255, 248, 240},	//  6120 K
+		{255, 251, 255},	//  6632 K
+		{238, 240, 255},	//  7144 K
+		{227, 233, 255},	//  7656 K
+		{219, 228, 255},	//  8168 K
+		{213, 225, 255},	//  8680 K
+		{208, 222, 255},	//  9192 K
+		{204, 219, 255},	//  9704 K
+		{200, 217, 255},	// 10216 K
+		{197, 215, 255},	// 10728 K
+		{195, 214, 255},	// 11240 K
+		{192, 212, 255},	// 11752 K
+		{190, 211, 255}		// 12264 K
+};
+#endif
+
+/**
+ *  @brief      Scale a by b/255
+ *  @param    	a value (0..255)
+ *  @param    	b factor (0..255)
+ *  @return		a * b / 255
+*/
+static inline uint8_t desklamp_scale(uint8_t a, uint8_t b){
+	return ((uint16_t)a * b + a) >> 8;
+}
+
+/**
+ *  @brief      Convert to linear light
+ *
+ *  Interpolates between the entries of pwmtable, so the result has more
+ *  resolution than the table itself.
+ *  @param    	x value * dimmer (0..65025)
+ *  @return		PWM value (8.8 fixed point)
+*/
+static uint16_t desklamp_gamma(uint16_t x){
+	uint8_t i = x >> 9;
+	uint8_t f = x >> 1;
+	uint8_t a = pgm_read_byte(&(pwmtable[i]));
+	uint8_t b = i < 127 ? pgm_read_byte(&(pwmtable[i + 1])) : 255;
+
+	return ((uint16_t)a << 8) + (uint16_t)(b - a) * f;
+}
+
+/**
+ *  @brief      Linear light of all channels
+ *  @param    	rgb red, green, blue
+ *  @param    	dimmer (0..255)
+ *  @param    	light linear light of channel 1..3 (8.8 fixed point)
+*/
+static void desklamp_get_light(const uint8_t *rgb, uint8_t dimmer, uint16_t *light){
+	uint8_t c;
+
+	if (DESKLAMP_IS_RGB()) {
+		for (c = 0; c < 3; c++) {
+			light[c] = desklamp_gamma((uint16_t)rgb[c] * dimmer);
+		}
+	} else {	// COLORMODE_MONO
+		light[0] = desklamp_gamma((uint16_t)255 * dimmer);
+		light[1] = 0;
+		light[2] = 0;
+	}
+}
+
+#if RESET_LOG == 1
+/**
+ *  @brief      Save and clear the reset cause
+ *
+ *  Runs in .init3, before .bss is cleared and before entropy_init() could
+ *  clear MCUSR. The bootloader clears MCUSR before it starts the firmware,
+ *  it hands the flags over in GPIOR0 (see bootLoaderInit() in
+ *  micronucleus/configuration/t84_desklamp/bootloaderconfig.h). GPIOR0 is
+ *  0 after any reset, so without that bootloader only MCUSR counts.
+ *  A watchdog reset leaves the watchdog enabled, it is disabled here until
+ *  entropy_init() sets it up again.
+*/
+void desklamp_save_reset_cause(void) __attribute__ ((naked, used, section (".init3")));
+void desklamp_save_reset_cause(void) {
+	reset_cause = MCUSR | GPIOR0;
+	MCUSR = 0;
+	GPIOR0 = 0;
+	wdt_disable();
+}
+
+/**
+ *  @brief      Count the reset cause in EEPROM
+ *
+ *  Only the counter of the current cause is updated, about one EEPROM
+ *  byte per boot. Counters stop at 0xFFFE, 0xFFFF is erased EEPROM.
+*/
+static void desklamp_count_reset(void) {
+	uint16_t *store;
+	uint16_t count;
+	uint8_t i;
+
+	for (i = 0; i < DESKLAMP_RESET_CAUSES; i++) {
+		if (!(reset_cause & (1 << i))) {
+			continue;
+		}
+		store = (uint16_t *)RESET_EEPROM_STORE + i;
+		count = eeprom_read_word(store);
+		if (count == 0xFFFF) {
+			count = 0;
+		}
+		if (count < 0xFFFE) {
+			DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_word(store, count + 1));
+		}
+	}
+}
+#endif
+
 /**
  *  @brief      Init Pins of Desklamp
 */
@@ -52,6 +249,12 @@ void desklamp_init(void) {
 	desklamp.state = DESKLAMP_STATE_IDLE;
 	desklamp.strobe = 0; // Strobe = 0 Hz
 	desklamp.blackout = 0;
+#if STROBE == 1
+	strobe_intensity = 255;
+#endif
+#if EFFECTS == 1
+	desklamp.effect = 255;
+#endif
 	desklamp.usb_ext = 1;
 
 	desklamp.r = 255;
@@ -59,6 +262,19 @@ void desklamp_init(void) {
 	desklamp.b = 255;
 	desklamp.dimmer = 255;
 
+#if POWERON == 1
+	// apply power-on look before the PWM is started
+	poweron_mode = eeprom_read_byte((unsigned char *)POWERON_EEPROM_STORE);
+	eeprom_read_block(poweron_look, (unsigned char *)POWERON_EEPROM_STORE + 1, 4);
+	if (poweron_mode == DESKLAMP_POWERON_LOOK || poweron_mode == DESKLAMP_POWERON_LAST) {
+		desklamp.r = poweron_look[0];
+		desklamp.g = poweron_look[1];
+		desklamp.b = poweron_look[2];
+		desklamp.dimmer = poweron_look[3];
+	}
+#endif
+
+#if FIXED_VARIANT == 0
 	desklamp.colormode = eeprom_read_byte((unsigned char *)COLORMODE_EEPROM_STORE);
 	if (desklamp.colormode == 0xFF) {
 		desklamp_set_colormode(COLORMODE);
@@ -68,17 +284,42 @@ void desklamp_init(void) {
 	if (desklamp.isAdapter == 0xFF) {
 		desklamp_set_adapter(USBADAPTER);
 	}
+#endif
 
 	eeprom_read_block(&desklamp.serial, (unsigned char *)SERIAL_EEPROM_STORE, 4);
 	if (desklamp.serial == 0xFFFFFFFF) {
-		entropy_init();
 		desklamp_set_serial(entropy_random());
 	}
+	entropy_seed(desklamp.serial);
+
+#if RESET_LOG == 1
+	desklamp_count_reset();
+#endif
+
+#if SCENE_COUNT > 0
+	eeprom_read_block(scenes, (unsigned char *)SCENE_EEPROM_STORE, sizeof(scenes));
+#endif
+
+#if FAILSAFE == 1
+	eeprom_read_block(&failsafe, (unsigned char *)FAILSAFE_EEPROM_STORE, sizeof(failsafe));
+	host_timeout = DESKLAMP_MS_TO_TICKS(failsafe.timeout * 1000UL);
+#endif
+
+	// Timer0 is the system tick, it runs even if the PWM is not started
+	TCCR0A |= (1 << WGM00) | (1 << WGM01);		// Fast PWM Mode 3
+	TCCR0B |= (1 << CS02);						// prescaler 256 	-> 183,10546875 Hz
+	TIMSK0 |= (1 << TOIE0);						// overflow is the system tick
 
 	// set Ext USB PIN as Input
 	DESKLAMP_LED_DDR &= ~(1 << DESKLAMP_PIN_DP_EXT);
 	DESKLAMP_LED_DDR &= ~(1 << DESKLAMP_PIN_DM_EXT);
 
+	// pin change interrupt on Ext USB PINs (V-USB uses INT0), adapters only
+	if (DESKLAMP_IS_ADAPTER()) {
+		PCMSK0 |= (1 << DESKLAMP_PCINT_DP_EXT) | (1 << DESKLAMP_PCINT_DM_EXT);
+	}
+	GIMSK |= (1 << PCIE0);
+
 	// set LED-ports to output
 	DESKLAMP_LED_DDR |= (1 << DESKLAMP_PIN_LED1);
 	DESKLAMP_LED_DDR |= (1 << DESKLAMP_PIN_LED2);
@@ -86,7 +327,7 @@ void desklamp_init(void) {
 
 	// switch leds on
 	desklamp_set_led(1, ON);
-	if (desklamp.colormode == DESKLAMP_COLORMODE_RGB) {
+	if (DESKLAMP_IS_RGB()) {
 		desklamp_set_led(2, ON);
 		desklamp_set_led(3, ON);
 	}
@@ -98,29 +339,31 @@ void desklamp_init(void) {
  *  @param    	state 	ENABLE, DISABLE
 */
 void desklamp_config_channel(uint8_t channel, uint8_t state){
-	switch (channel) {
-		case 1:												// Channel 1
-			if (state == ENABLE)
-				TCCR0A |= (1 << COM0B1);					// Non-Inverting PWM
-			else {
-				TCCR0A &= ~(1 << COM0B1);					// Normal Pin operation
-			}
-			break;
-		case 2:												// Channel 2
-			if (state == ENABLE)
-				TCCR1A |= (1 << COM1A1);					// Non-Inverting PWM
-			else {
-				TCCR1A &= ~(1 << COM1A1);					// Normal Pin operation
-			}
-			break;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {					// COM bits are also written by the strobe
+		switch (channel) {
+			case 1:												// Channel 1
+				if (state == ENABLE)
+					TCCR0A |= (1 << COM0B1);					// Non-Inverting PWM
+				else {
+					TCCR0A &= ~(1 << COM0B1);					// Normal Pin operation
+				}
+				break;
+			case 2:												// Channel 2
+				if (state == ENABLE)
+					TCCR1A |= (1 << COM1A1);					// Non-Inverting PWM
+				else {
+					TCCR1A &= ~(1 << COM1A1);					// Normal Pin operation
+				}
+				break;
 
-		case 3:												// Channel 3
-			if (state == ENABLE)
-				TCCR1A |= (1 << COM1B1);					// Non-Inverting PWM
-			else {
-				TCCR1A &= ~(1 << COM1B1);					// Normal Pin operation
-			}
-			break;
+			case 3:												// Channel 3
+				if (state == ENABLE)
+					TCCR1A |= (1 << COM1B1);					// Non-Inverting PWM
+				else {
+					TCCR1A &= ~(1 << COM1B1);					// Normal Pin operation
+				}
+				break;
+		}
 	}
 }
 
@@ -128,24 +371,28 @@ void desklamp_config_channel(uint8_t channel, uint8_t state){
  *  @brief      Init PWM-Hardware
 */
 void desklamp_init_pwm(void) {
-	// init timers as fast PWM
-	TCCR0A |= (1 << WGM00) | (1 << WGM01);		// Fast PWM Mode 3
+	// init timers as fast PWM (Timer0 is already running, see desklamp_init())
 	TCCR1A |= (1 << WGM10) | (1 << WGM12);		// Fast PWM Mode 5 (8bit)
 	ICR1 = 0xff;
 
 	// set prescaler 256
-	TCCR0B |= (1 << CS02);						// prescaler 256 	-> 183,10546875 Hz
-	if (desklamp.colormode == DESKLAMP_COLORMODE_RGB) {
-		TCCR1B |= (1 << CS12);					// prescaler 256	->  90Hz
+	if (DESKLAMP_IS_RGB()) {
+		TCCR1B = (TCCR1B & ~((1 << CS12) | (1 << CS11) | (1 << CS10))) | (1 << CS12);	// prescaler 256	->  90Hz
 	}
 
 	// set outputs to PWM
 	desklamp_config_channel(1, ENABLE);			// Non-Inverting PWM 1
-	if (desklamp.colormode == DESKLAMP_COLORMODE_RGB) {
+	if (DESKLAMP_IS_RGB()) {
 		desklamp_config_channel(2, ENABLE);		// Non-Inverting PWM 2
 		desklamp_config_channel(3, ENABLE);		// Non-Inverting PWM 3
 	}
 
+	// pins are low whenever a channel is disabled
+	desklamp_set_led(1, OFF);
+	desklamp_set_led(2, OFF);
+	desklamp_set_led(3, OFF);
+	desklamp.usb_ext = 0;
+
 	desklamp_update_pwm();
 }
 
@@ -193,6 +440,9 @@ void desklamp_set_led(uint8_t led, uint8_t onoff) {
  *  @param    	intensity (0..255)
 */
 void desklamp_set_led_intensity(uint8_t led, uint8_t intensity){
+#if FADE == 1
+	fade.step = 0;
+#endif
 	switch (led) {
 		case 1:		// led red or single
 			desklamp.r = intensity;
@@ -216,6 +466,9 @@ void desklamp_set_led_intensity(uint8_t led, uint8_t intensity){
  *  @param    	b blue (0..255)
 */
 void desklamp_set_rgb(uint8_t r, uint8_t g, uint8_t b){
+#if FADE == 1
+	fade.step = 0;
+#endif
 	desklamp.r = r;
 	desklamp.g = g;
 	desklamp.b = b;
@@ -223,21 +476,205 @@ void desklamp_set_rgb(uint8_t r, uint8_t g, uint8_t b){
 	desklamp_update_pwm();
 }
 
+#if HSV == 1
+/**
+ *  @brief      Convert HSV to RGB in fixed point
+ *  @param    	hue (0..65535 = 0..360 deg)
+ *  @param    	sat saturation (0..255)
+ *  @param    	val value (0..255)
+ *  @param    	rgb red, green, blue
+*/
+static void desklamp_hsv_to_rgb(uint16_t hue, uint8_t sat, uint8_t val, uint8_t *rgb){
+	uint32_t h6 = (uint32_t)hue * 6;
+	uint8_t f = h6 >> 8;								// position within sector
+	uint8_t p = desklamp_scale(val, 255 - sat);
+	uint8_t q = desklamp_scale(val, 255 - desklamp_scale(sat, f));
+	uint8_t t = desklamp_scale(val, 255 - desklamp_scale(sat, 255 - f));
+
+	switch ((uint8_t)(h6 >> 16)) {						// sector (0..5)
+		case 0:
+			rgb[0] = val; rgb[1] = t; rgb[2] = p;
+			break;
+		case 1:
+			rgb[0] = q; rgb[1] = val; rgb[2] = p;
+			break;
+		case 2:
+			rgb[0] = p; rgb[1] = val; rgb[2] = t;
+			break;
+		case 3:
+			rgb[0] = p; rgb[1] = q; rgb[2] = val;
+			break;
+		case 4:
+			rgb[0] = t; rgb[1] = p; rgb[2] = val;
+			break;
+		default:
+			rgb[0] = val; rgb[1] = p; rgb[2] = q;
+			break;
+	}
+}
+
+/**
+ *  @brief      Set HSV Value
+ *
+ *  The HSV value is kept until the next call, desklamp_set_rgb() does
+ *  not update it.
+ *  @param    	hue (0..65535 = 0..360 deg)
+ *  @param    	sat saturation (0..255)
+ *  @param    	val value (0..255)
+*/
+void desklamp_set_hsv(uint16_t hue, uint8_t sat, uint8_t val){
+	uint8_t rgb[3];
+
+	desklamp.hue = hue;
+	desklamp.sat = sat;
+	desklamp.val = val;
+
+	desklamp_hsv_to_rgb(hue, sat, val, rgb);
+	desklamp_set_rgb(rgb[0], rgb[1], rgb[2]);
+}
+#endif
+
+#if CCT == 1
+/**
+ *  @brief      Set color temperature
+ *
+ *  Interpolates the RGB value from ccttable, the dimmer is applied
+ *  as usual by desklamp_update_pwm().
+ *  @param    	kelvin (CCT_MIN_KELVIN..CCT_MAX_KELVIN)
+ *  @param    	tint (-128..127, positive = green, negative = magenta)
+*/
+void desklamp_set_cct(uint16_t kelvin, int8_t tint){
+	uint8_t rgb[3];
+	uint8_t i, f, c, tintscale;
+
+	if (kelvin < CCT_MIN_KELVIN) {
+		kelvin = CCT_MIN_KELVIN;
+	} else if (kelvin > CCT_MAX_KELVIN) {
+		kelvin = CCT_MAX_KELVIN;
+	}
+	desklamp.kelvin = kelvin;
+	desklamp.tint = tint;
+
+	kelvin -= CCT_MIN_KELVIN;
+	i = kelvin >> 9;									// table index
+	f = kelvin >> 1;									// position between entries
+	for (c = 0; c < 3; c++) {
+		rgb[c] = ((uint16_t)pgm_read_byte(&(ccttable[i][c])) * (256 - f)
+				+ (uint16_t)pgm_read_byte(&(ccttable[i + 1][c])) * f) >> 8;
+	}
+
+	tintscale = 255 - ((tint < 0 ? -(tint + 1) : tint) << 1);
+	if (tint > 0) {
+		rgb[0] = desklamp_scale(rgb[0], tintscale);
+		rgb[2] = desklamp_scale(rgb[2], tintscale);
+	} else if (tint < 0) {
+		rgb[1] = desklamp_scale(rgb[1], tintscale);
+	}
+
+	desklamp_set_rgb(rgb[0], rgb[1], rgb[2]);
+}
+#endif
+
 /**
  *  @brief      Set desklamp dimmer
  *  @param    	dimmer (0..255)
 */
 void desklamp_set_dimmer(uint8_t dimmer){
+#if FADE == 1
+	fade.step = 0;
+#endif
 	desklamp.dimmer = dimmer;
 
 	desklamp_update_pwm();
 }
 
+#if FADE == 1
+/**
+ *  @brief      Is a fade running?
+ *  @return		1 = fade running, 0 = no fade
+*/
+uint8_t desklamp_is_fading(void){
+	return fade.step ? 1 : 0;
+}
+
+/**
+ *  @brief      Interpolate linear light of fade
+ *  @param    	c channel (0..2)
+ *  @return		linear light at current fade position (8.8 fixed point)
+*/
+static uint16_t desklamp_fade_light(uint8_t c){
+	uint16_t from = fade.light_from[c];
+	uint16_t to = fade.light_to[c];
+	uint16_t pos = fade.pos >> 8;
+
+	// unsigned magnitude, 65535 * 65535 does not fit int32_t
+	if (to >= from) {
+		return from + (uint16_t)(((uint32_t)(to - from) * pos) >> 16);
+	}
+	return from - (uint16_t)(((uint32_t)(from - to) * pos) >> 16);
+}
+
+/**
+ *  @brief      Fade to RGB and dimmer value
+ *
+ *  The fade is calculated by desklamp_tick(), setting RGB or dimmer
+ *  directly stops it. The output is interpolated in linear light, so
+ *  fades between saturated colors keep their brightness. r, g, b and
+ *  dimmer follow the fade in encoded values for the GET reports.
+ *  @param    	r red (0..255)
+ *  @param    	g green (0..255)
+ *  @param    	b blue (0..255)
+ *  @param    	dimmer (0..255)
+ *  @param    	time fade time (ms)
+*/
+void desklamp_fade(uint8_t r, uint8_t g, uint8_t b, uint8_t dimmer, uint16_t time){
+	uint16_t fadeticks = DESKLAMP_MS_TO_TICKS(time);
+	uint8_t rgb[3] = {desklamp.r, desklamp.g, desklamp.b};
+	uint8_t c;
+
+	if (fade.step) {							// continue from running fade
+		for (c = 0; c < 3; c++) {
+			fade.light_from[c] = desklamp_fade_light(c);
+		}
+	} else {
+		desklamp_get_light(rgb, desklamp.dimmer, fade.light_from);
+	}
+	fade.from[0] = desklamp.r;
+	fade.from[1] = desklamp.g;
+	fade.from[2] = desklamp.b;
+	fade.from[3] = desklamp.dimmer;
+	fade.to[0] = r;
+	fade.to[1] = g;
+	fade.to[2] = b;
+	fade.to[3] = dimmer;
+	desklamp_get_light(fade.to, dimmer, fade.light_to);
+	fade.pos = 0;
+	fade.step = fadeticks ? (1UL << 24) / fadeticks : (1UL << 24);
+}
+
+/**
+ *  @brief      Interpolate fade channel
+ *  @param    	c channel (0..3 = r, g, b, dimmer)
+ *  @return		value at current fade position
+*/
+static uint8_t desklamp_fade_value(uint8_t c){
+	int16_t delta = fade.to[c] - fade.from[c];
+
+	if (!fade.step) {
+		return fade.to[c];
+	}
+	return fade.from[c] + (int16_t)(((int32_t)delta * (uint16_t)(fade.pos >> 8)) >> 16);
+}
+#endif
+
 /**
  *  @brief      Set Colormode
+ *
+ *  Ignored in fixed variants.
  *  @param    	colormode (RGB, MONO)
 */
 void desklamp_set_colormode(uint8_t colormode){
+#if FIXED_VARIANT == 0
 	switch (colormode) {
 		case DESKLAMP_COLORMODE_RGB:
 			desklamp.colormode = DESKLAMP_COLORMODE_RGB;
@@ -246,30 +683,434 @@ void desklamp_set_colormode(uint8_t colormode){
 			desklamp.colormode = DESKLAMP_COLORMODE_MONO;
 			break;
 	}
-	eeprom_write_byte((unsigned char *)COLORMODE_EEPROM_STORE, desklamp.colormode);
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_write_byte((unsigned char *)COLORMODE_EEPROM_STORE, desklamp.colormode));
+#endif
 }
 
 /**
  *  @brief      Set adapter
+ *
+ *  Ignored in fixed variants.
  *  @param    	isAdapter (0, 1)
 */
 void desklamp_set_adapter(uint8_t isAdapter){
+#if FIXED_VARIANT == 0
 	desklamp.isAdapter = isAdapter ? 1 : 0;
-	eeprom_write_byte((unsigned char *)ADAPTER_EEPROM_STORE, desklamp.isAdapter);
+	if (desklamp.isAdapter) {
+		PCMSK0 |= (1 << DESKLAMP_PCINT_DP_EXT) | (1 << DESKLAMP_PCINT_DM_EXT);
+	} else {
+		PCMSK0 &= ~((1 << DESKLAMP_PCINT_DP_EXT) | (1 << DESKLAMP_PCINT_DM_EXT));
+	}
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_write_byte((unsigned char *)ADAPTER_EEPROM_STORE, desklamp.isAdapter));
+#endif
 }
 
 void desklamp_set_serial(uint32_t serial) {
 	desklamp.serial = serial;
-	eeprom_write_block(&desklamp.serial, (unsigned char *)SERIAL_EEPROM_STORE, 4);
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_write_block(&desklamp.serial, (unsigned char *)SERIAL_EEPROM_STORE, 4));
 }
 
+#if STROBE == 1
+/**
+ *  @brief      Calculate flash width in ticks
+ *
+ *  At least one tick of the period stays dark.
+*/
+static void desklamp_update_strobe_width(void){
+	uint32_t period = strobe_inc ? 0xFFFFFFFFUL / strobe_inc : 2;	// ticks per flash
+	uint32_t width;
+
+	if (strobe_duty) {
+		width = period * strobe_duty / 100;
+	} else {
+		width = DESKLAMP_MS_TO_TICKS(strobe_ms);
+	}
+	if (width >= period) {
+		width = period - 1;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		strobe_width = width ? width : 1;
+	}
+}
+#endif
+
 /**
  *  @brief      Set desklamp strobe
- *  @param    	strobe (0..255)
+ *
+ *  A running strobe keeps its phase, so the rate can be changed without
+ *  a gap. A new strobe flashes on the next tick.
+ *  @param    	freq frequency (0.01 Hz, 0 = off, max. STROBE_MAX_CHZ)
+*/
+void desklamp_set_strobe(uint16_t freq){
+	if (freq > STROBE_MAX_CHZ) {
+		freq = STROBE_MAX_CHZ;
+	}
+	desklamp.strobe = freq;
+#if STROBE == 1
+	uint32_t inc = (uint32_t)freq * STROBE_INC_PER_CHZ;
+	uint32_t phase = -inc;								// first flash on the next tick
+
+	if (!strobe_inc) {									// only written in main context, no lock needed
+#if STROBE_BEAT == 1
+		strobe_adjust = 0;
+#endif
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			strobe_phase = phase;
+			strobe_flash = 0;
+			strobe_inc = inc;
+		}
+	} else {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			strobe_inc = inc;
+		}
+	}
+	desklamp_update_strobe_width();
+	desklamp_update_pwm();
+#endif
+}
+
+#if STROBE == 1
+/**
+ *  @brief      Set strobe flash
+ *  @param    	ms flash width (ms), 0 = one tick, ignored if duty is set
+ *  @param    	duty flash width (1..100 % of period), 0 = use ms
+ *  @param    	intensity flash intensity (0..255)
+*/
+void desklamp_set_strobe_flash(uint16_t ms, uint8_t duty, uint8_t intensity){
+	strobe_ms = ms;
+	strobe_duty = duty;
+	strobe_intensity = intensity;
+	desklamp_update_strobe_width();
+	desklamp_update_pwm();
+}
+
+#if STROBE_BEAT == 1
+/**
+ *  @brief      Beat for tempo-locked strobe
+ *
+ *  Called when the host sends a beat. The strobe runs on its own and is
+ *  pulled to the beats by a PLL: half of the phase error is corrected at
+ *  once, the frequency is trimmed by half of the error per tick since the
+ *  last beat. Beats may be sent every beat or only once per bar.
+ *
+ *  Without a tempo, the tempo is taken from the interval since the last
+ *  beat (tap tempo), sub is then the number of flashes per interval.
+ *  @param    	bpm tempo (0.01 BPM), 0 = from beat interval
+ *  @param    	sub flashes per beat (0, 1 = on the beat)
+*/
+void desklamp_strobe_beat(uint16_t bpm, uint8_t sub){
+	uint16_t interval = beat_ticks;
+	uint32_t inc = strobe_inc;
+	uint32_t rate;
+	uint32_t phase = 0;
+	int32_t error = 0;
+	uint8_t start = !strobe_inc;						// strobe_inc is only written here and in desklamp_set_strobe()
+
+	beat_ticks = 0;
+	if (!sub) {
+		sub = 1;
+	}
+	if (bpm != beat_bpm || sub != beat_sub) {
+		beat_bpm = bpm;
+		beat_sub = sub;
+		beat_trim = 0;
+	}
+	if (interval >= DESKLAMP_MS_TO_TICKS(STROBE_BEAT_TIMEOUT)) {
+		interval = 0;										// first beat after a pause
+	}
+
+	if (bpm) {
+		rate = (uint32_t)bpm * sub;							// flashes per minute (0.01)
+		if (rate > STROBE_MAX_CHZ * 60UL) {
+			rate = STROBE_MAX_CHZ * 60UL;
+		}
+		inc = rate * STROBE_INC_PER_CBPM;
+	} else if (interval) {
+		rate = 0xFFFFFFFFUL / interval;						// increment for one flash per interval
+		inc = (uint32_t)STROBE_MAX_CHZ * STROBE_INC_PER_CHZ;
+		if (rate < inc / sub) {
+			inc = rate * sub;
+		}
+	}
+
+	if (start) {											// flash on next tick
+		phase = -inc;
+	} else {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			error = strobe_phase;							// > 0: flash was early
+		}
+		error /= 2;
+		if (bpm && interval) {
+			beat_trim -= error / interval;
+			if (beat_trim > (int32_t)(inc >> 4)) {			// max. 6 % off the tempo
+				beat_trim = inc >> 4;
+			} else if (beat_trim < -(int32_t)(inc >> 4)) {
+				beat_trim = -(int32_t)(inc >> 4);
+			}
+		}
+	}
+	rate = bpm ? inc + beat_trim : inc;
+
+	// the phase keeps running meanwhile, so the timer subtracts the correction
+	// on its next tick. A correction still pending is kept, the next beat
+	// catches up.
+	if (start) {
+		strobe_adjust = 0;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			strobe_phase = phase;
+			strobe_flash = 0;
+			strobe_inc = rate;
+		}
+	} else {
+		if (!strobe_adjust) {
+			strobe_error = error;
+			strobe_adjust = 1;
+		}
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			strobe_inc = rate;
+		}
+	}
+	desklamp.strobe = inc / STROBE_INC_PER_CHZ;
+	desklamp_update_strobe_width();
+	desklamp_update_pwm();
+}
+#endif
+
+/**
+ *  @brief      Set desklamp strobe from legacy value
+ *  @param    	strobe (0..255 = 0, 1.1 .. 30.5 Hz)
+*/
+void desklamp_set_strobe_legacy(uint8_t strobe){
+	desklamp_set_strobe(strobe ? DESKLAMP_TICK_CHZ / pgm_read_byte(&(strobetable[strobe])) : 0);
+}
+#endif
+
+#if SCENE_COUNT > 0
+/**
+ *  @brief      Store current look as scene
+ *  @param    	scene (0..SCENE_COUNT - 1)
+*/
+void desklamp_store_scene(uint8_t scene){
+	if (scene >= SCENE_COUNT) {
+		return;
+	}
+	scenes[scene].r = desklamp.r;
+	scenes[scene].g = desklamp.g;
+	scenes[scene].b = desklamp.b;
+	scenes[scene].dimmer = desklamp.dimmer;
+	scenes[scene].strobe = desklamp.strobe;
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_block(&scenes[scene], (unsigned char *)SCENE_EEPROM_STORE + scene * sizeof(desklamp_scene_t), sizeof(desklamp_scene_t)));
+}
+
+/**
+ *  @brief      Recall scene
+ *
+ *  Scenes are read from the SRAM cache. Slots that were never stored
+ *  are ignored.
+ *  @param    	scene (0..SCENE_COUNT - 1)
+ *  @param    	time fade time (ms), ignored without FADE
+*/
+void desklamp_recall_scene(uint8_t scene, uint16_t time){
+	desklamp_scene_t *s;
+
+	if (scene >= SCENE_COUNT) {
+		return;
+	}
+	s = &scenes[scene];
+	if ((s->r & s->g & s->b & s->dimmer) == 0xFF && s->strobe == 0xFFFF) {	// erased EEPROM
+		return;
+	}
+	desklamp_set_strobe(s->strobe);
+#if FADE == 1
+	desklamp_fade(s->r, s->g, s->b, s->dimmer, time);
+#else
+	desklamp.dimmer = s->dimmer;
+	desklamp_set_rgb(s->r, s->g, s->b);
+#endif
+}
+#endif
+
+#if POWERON == 1
+/**
+ *  @brief      Set power-on behaviour
+ *  @param    	mode (DESKLAMP_POWERON_FULL, _LOOK, _LAST)
+ *  @param    	r red of power-on look (0..255)
+ *  @param    	g green of power-on look (0..255)
+ *  @param    	b blue of power-on look (0..255)
+ *  @param    	dimmer dimmer of power-on look (0..255)
+*/
+void desklamp_set_poweron(uint8_t mode, uint8_t r, uint8_t g, uint8_t b, uint8_t dimmer){
+	poweron_mode = mode;
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_byte((unsigned char *)POWERON_EEPROM_STORE, mode));
+	if (mode == DESKLAMP_POWERON_LOOK) {
+		poweron_look[0] = r;
+		poweron_look[1] = g;
+		poweron_look[2] = b;
+		poweron_look[3] = dimmer;
+		DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_block(poweron_look, (unsigned char *)POWERON_EEPROM_STORE + 1, 4));
+	}
+}
+
+/**
+ *  @brief      Save last state for power-on
+ *
+ *  Called every tick. The state is written to EEPROM once it was unchanged
+ *  for POWERON_SAVE_DELAY, so fades and effects do not wear out the EEPROM.
+*/
+static void desklamp_save_last_state(void){
+	uint8_t look[4] = {desklamp.r, desklamp.g, desklamp.b, desklamp.dimmer};
+
+	if (memcmp(look, poweron_look, sizeof(look))) {
+		memcpy(poweron_look, look, sizeof(look));
+		poweron_delay = DESKLAMP_MS_TO_TICKS(POWERON_SAVE_DELAY);
+	} else if (poweron_delay && !--poweron_delay) {
+		DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_block(poweron_look, (unsigned char *)POWERON_EEPROM_STORE + 1, 4));
+	}
+}
+#endif
+
+#if FAILSAFE == 1
+/**
+ *  @brief      Set failsafe behaviour
+ *  @param    	mode (DESKLAMP_FAILSAFE_HOLD, _SCENE, _BLACKOUT)
+ *  @param    	timeout host timeout (s), 0 = bus reset only
+ *  @param    	scene scene for DESKLAMP_FAILSAFE_SCENE
+ *  @param    	time fade time (ms)
+*/
+void desklamp_set_failsafe(uint8_t mode, uint8_t timeout, uint8_t scene, uint16_t time){
+	failsafe.mode = mode;
+	failsafe.timeout = timeout;
+	failsafe.scene = scene;
+	failsafe.time = time;
+	host_timeout = DESKLAMP_MS_TO_TICKS(timeout * 1000UL);
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_block(&failsafe, (unsigned char *)FAILSAFE_EEPROM_STORE, sizeof(failsafe)));
+}
+
+/**
+ *  @brief      Host activity
+ *
+ *  Called for every SET report, restarts the host timeout.
+*/
+void desklamp_host_active(void){
+	host_active = 1;
+	host_idle = 0;
+}
+
+/**
+ *  @brief      Standalone playback running?
+ *
+ *  A sequence, a program or a macro replay needs no host, the host
+ *  timeout is suspended while one of them runs.
+ *  @return		1 = running, 0 = stopped
+*/
+static uint8_t desklamp_standalone(void){
+#if SEQUENCE == 1
+	if (sequence_is_playing()) {
+		return 1;
+	}
+#endif
+#if VM == 1
+	if (vm_is_running()) {
+		return 1;
+	}
+#endif
+#if MACRO == 1
+	if (macro_get_mode() == MACRO_REPLAY_ONCE || macro_get_mode() == MACRO_REPLAY_LOOP) {
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/**
+ *  @brief      Stop playback and modulation
+ *
+ *  Otherwise the next keyframe, program step or effect overwrites the
+ *  failsafe look.
+*/
+static void desklamp_stop_playback(void){
+#if SEQUENCE == 1
+	sequence_play(SEQUENCE_STOP);
+#endif
+#if VM == 1
+	vm_run(0);
+#endif
+#if MACRO == 1
+	macro_set_mode(MACRO_STOP);				// a recording is saved
+#endif
+#if EFFECTS == 1
+	effect_set(EFFECT_NONE, 0, 0);
+#endif
+#if LFO == 1
+	lfo_set(DESKLAMP_MOD_NONE, 0, 0, 0, 0);
+#endif
+}
+
+/**
+ *  @brief      Host lost
+ *
+ *  Called on host timeout and USB bus reset. Only acts if the host has
+ *  sent a SET report since the last call, so enumeration at power-on does
+ *  not trigger the failsafe.
+*/
+void desklamp_host_lost(void){
+	if (!host_active) {
+		return;
+	}
+	host_active = 0;
+
+	if (failsafe.mode != DESKLAMP_FAILSAFE_HOLD) {
+		desklamp_stop_playback();
+	}
+	switch (failsafe.mode) {
+#if SCENE_COUNT > 0
+		case DESKLAMP_FAILSAFE_SCENE:
+			desklamp_recall_scene(failsafe.scene, failsafe.time);
+			break;
+#endif
+		case DESKLAMP_FAILSAFE_BLACKOUT:
+			desklamp_set_strobe(0);
+#if FADE == 1
+			desklamp_fade(desklamp.r, desklamp.g, desklamp.b, 0, failsafe.time);
+#else
+			desklamp_set_dimmer(0);
+#endif
+			break;
+	}
+}
+#endif
+
+#if RESET_LOG == 1
+/**
+ *  @brief      Clear the reset counters
+*/
+void desklamp_clear_reset_counts(void){
+	uint8_t i;
+
+	for (i = 0; i < DESKLAMP_RESET_CAUSES; i++) {
+		DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_word((uint16_t *)RESET_EEPROM_STORE + i, 0));
+	}
+}
+
+/**
+ *  @brief      Get the reset cause
+ *  @return		MCUSR at boot, bit DESKLAMP_RESET_*
+*/
+uint8_t desklamp_get_reset_cause(void){
+	return reset_cause ? reset_cause : 1 << DESKLAMP_RESET_UNAVAILABLE;
+}
+
+/**
+ *  @brief      Get a reset counter
+ *  @param    	cause DESKLAMP_RESET_*
+ *  @return		number of resets
 */
-void desklamp_set_strobe(uint8_t strobe){
-		desklamp.strobe = strobe;
+uint16_t desklamp_get_reset_count(uint8_t cause){
+	uint16_t count = eeprom_read_word((uint16_t *)RESET_EEPROM_STORE + cause);
+
+	return count == 0xFFFF ? 0 : count;
 }
+#endif
 
 /**
  *  @brief      Set desklamp blackout
@@ -279,6 +1120,40 @@ void desklamp_set_blackout(uint8_t blackout) {
 		desklamp.blackout = blackout;
 }
 
+#if EFFECTS == 1
+/**
+ *  @brief      Set effect level
+ *
+ *  The level scales the dimmer in desklamp_update_pwm().
+ *  @param    	level (0..255, 255 = no effect)
+*/
+void desklamp_set_effect_level(uint8_t level){
+	if (level != desklamp.effect) {
+		desklamp.effect = level;
+		desklamp_update_pwm();
+	}
+}
+#endif
+
+#if LFO == 1
+/**
+ *  @brief      Set modulation
+ *
+ *  The modulation is applied in desklamp_update_pwm() on top of the
+ *  current look.
+ *  @param    	target (DESKLAMP_MOD_NONE, _DIMMER, _HUE, _RED, _GREEN, _BLUE)
+ *  @param    	mod hue offset (-32768..32767 = -180..180 deg) or
+ *  			scale of target (0..255, 255 = no modulation)
+*/
+void desklamp_set_modulation(uint8_t target, int16_t mod){
+	if (target != desklamp.mod_target || mod != desklamp.mod) {
+		desklamp.mod_target = target;
+		desklamp.mod = mod;
+		desklamp_update_pwm();
+	}
+}
+#endif
+
 /**
  *  @brief      Set current desklamp state
  *  @param    	state (compare desklamp.h)
@@ -291,12 +1166,10 @@ void desklamp_set_state(uint8_t state){
 /** GET Functions */
 
 /**
- *  @brief      Get current strobe value
- *
- *  experimental
- *  @return		strobe (Hz)
+ *  @brief      Get current strobe frequency
+ *  @return		strobe (0.01 Hz)
 */
-uint8_t desklamp_get_strobe(void){
+uint16_t desklamp_get_strobe(void){
 	return desklamp.strobe;
 }
 
@@ -314,7 +1187,11 @@ uint8_t desklamp_get_state(void){
  *  @return		colormode (RGB, MONO)
 */
 uint8_t desklamp_get_colormode(void){
+#if FIXED_VARIANT == 1
+	return COLORMODE;
+#else
 	return desklamp.colormode;
+#endif
 }
 
 /**
@@ -322,7 +1199,11 @@ uint8_t desklamp_get_colormode(void){
  *  @return		1 = adapter, 0 = directly connected LEDs
 */
 uint8_t desklamp_is_adapter(void){
+#if FIXED_VARIANT == 1
+	return USBADAPTER;
+#else
 	return desklamp.isAdapter;
+#endif
 }
 
 /**
@@ -363,38 +1244,281 @@ uint8_t desklamp_get_rgb(char c){
 	return return_val;
 }
 
+#if HSV == 1
+/**
+ *  @brief      Get last HSV Value
+ *  @param    	c ('h', 's', 'v')
+ *  @return		value
+*/
+uint16_t desklamp_get_hsv(char c){
+	uint16_t return_val = 0;
+
+	switch (c) {
+		case 'h':
+			return_val = desklamp.hue;
+			break;
+		case 's':
+			return_val = desklamp.sat;
+			break;
+		case 'v':
+			return_val = desklamp.val;
+			break;
+	}
+	return return_val;
+}
+#endif
+
+#if CCT == 1
+/**
+ *  @brief      Get last color temperature
+ *  @return		kelvin
+*/
+uint16_t desklamp_get_cct(void){
+	return desklamp.kelvin;
+}
+
+/**
+ *  @brief      Get last color temperature tint
+ *  @return		tint (-128..127)
+*/
+int8_t desklamp_get_tint(void){
+	return desklamp.tint;
+}
+#endif
+
 
 /* General Functions */
 
+#if POWER_LIMIT == 1
+/**
+ *  @brief      Limit total LED current to the power budget
+ *
+ *  Scales all channels by the same factor to preserve the hue.
+ *  @param    	pwm PWM values of channel 1..3
+*/
+static void desklamp_limit_power(uint8_t *pwm){
+	uint32_t total = (uint16_t)pwm[0] * POWER_WEIGHT_R_MA
+				   + (uint16_t)pwm[1] * POWER_WEIGHT_G_MA
+				   + (uint16_t)pwm[2] * POWER_WEIGHT_B_MA;
+
+	if (total > (uint32_t)POWER_BUDGET_MA * 255) {
+		uint8_t scale = ((uint32_t)POWER_BUDGET_MA * 255 << 8) / total;
+		pwm[0] = ((uint16_t)pwm[0] * scale) >> 8;
+		pwm[1] = ((uint16_t)pwm[1] * scale) >> 8;
+		pwm[2] = ((uint16_t)pwm[2] * scale) >> 8;
+	}
+}
+#endif
+
 /**
  *  @brief      Update current PWM Values
 */
 void desklamp_update_pwm(void){
-	uint16_t dimmer = desklamp.dimmer;
-	if (desklamp.blackout) {
-		dimmer = 0;
-	}
-	if (desklamp.colormode == DESKLAMP_COLORMODE_RGB) {
-		uint8_t red_pwm = pgm_read_byte(&(pwmtable[(((uint16_t)desklamp.r * dimmer) >> 9)]));
-		if (red_pwm == 0) {
-			desklamp_set_led(1, OFF);
-			desklamp_config_channel(1, DISABLE);
-		} else {
-			OCR0B = red_pwm;
-			desklamp_config_channel(1, ENABLE);
+	uint8_t rgb[3] = {desklamp.r, desklamp.g, desklamp.b};
+	uint8_t scale[3];							// dimming of channel 1..3
+	uint16_t light[3];
+	uint8_t pwm[3];
+	uint8_t c;
+
+	scale[0] = desklamp.blackout ? 0 : 255;
+#if STROBE == 1
+	if (strobe_inc) {
+		scale[0] = desklamp_scale(scale[0], strobe_intensity);
+	}
+#endif
+#if EFFECTS == 1
+	scale[0] = desklamp_scale(scale[0], desklamp.effect);
+#endif
+#if LFO == 1
+	if (desklamp.mod_target == DESKLAMP_MOD_DIMMER) {
+		scale[0] = desklamp_scale(scale[0], desklamp.mod);
+	}
+#endif
+	scale[1] = scale[0];
+	scale[2] = scale[0];
+
+	desklamp_get_light(rgb, desklamp.dimmer, light);
+#if FADE == 1
+	if (fade.step) {
+		for (c = 0; c < 3; c++) {
+			light[c] = desklamp_fade_light(c);
 		}
-		OCR1A = pgm_read_byte(&(pwmtable[(((uint16_t)desklamp.g * dimmer) >> 9)]));
-		OCR1B = pgm_read_byte(&(pwmtable[(((uint16_t)desklamp.b * dimmer) >> 9)]));
-	} else {	// COLORMODE_MONO
-		uint8_t pwm = pgm_read_byte(&(pwmtable[((uint8_t)dimmer >> 1)]));
-		if (pwm == 0) {
-			desklamp_set_led(1, OFF);
-			desklamp_config_channel(1, DISABLE);
-		} else {
-			OCR0B = pwm;
-			desklamp_config_channel(1, ENABLE);
+	}
+#endif
+#if LFO == 1
+	switch (desklamp.mod_target) {
+#if HSV == 1
+		case DESKLAMP_MOD_HUE:
+			desklamp_hsv_to_rgb(desklamp.hue + desklamp.mod, desklamp.sat, desklamp.val, rgb);
+			desklamp_get_light(rgb, desklamp.dimmer, light);
+			break;
+#endif
+		case DESKLAMP_MOD_RED:
+		case DESKLAMP_MOD_GREEN:
+		case DESKLAMP_MOD_BLUE:
+			c = desklamp.mod_target - DESKLAMP_MOD_RED;
+			scale[c] = desklamp_scale(scale[c], desklamp.mod);
+			break;
+	}
+#endif
+
+	// dim in linear light and round to PWM value
+	for (c = 0; c < 3; c++) {
+		if (scale[c] != 255) {
+			light[c] = ((uint32_t)light[c] * desklamp_gamma((uint16_t)scale[c] * 255)) >> 16;
 		}
+		pwm[c] = (light[c] + 128) >> 8;
+	}
+
+#if POWER_LIMIT == 1
+	desklamp_limit_power(pwm);
+#endif
+
+	OCR0B = pwm[0];
+	if (DESKLAMP_IS_RGB()) {
+		OCR1A = pwm[1];
+		OCR1B = pwm[2];
 	}
+#if DIAGNOSTICS == 1
+	diag_output_latched();
+#endif
+
+#if STROBE == 1
+	// outputs during flash, applied by the timer interrupt
+	uint8_t on0 = pwm[0] ? (1 << COM0B1) : 0;
+	uint8_t on1 = DESKLAMP_IS_RGB() ? (1 << COM1A1) | (1 << COM1B1) : 0;
+	uint8_t flash;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		strobe_on0 = on0;
+		strobe_on1 = on1;
+	}
+#endif
+
+	do {
+		c = ENABLE;
+#if STROBE == 1
+		flash = strobe_flash;
+		if (strobe_inc && !flash) {						// dark phase of the strobe
+			c = DISABLE;
+		}
+#endif
+		desklamp_config_channel(1, pwm[0] ? c : DISABLE);
+		if (DESKLAMP_IS_RGB()) {
+			desklamp_config_channel(2, c);
+			desklamp_config_channel(3, c);
+		}
+#if STROBE == 1
+	} while (flash != strobe_flash);					// timer interrupt switched the flash meanwhile
+#else
+	} while (0);
+#endif
+}
+
+/**
+ *  @brief      Get elapsed system ticks
+ *
+ *  Returns the number of ticks since the last call.
+ *  @return		ticks
+*/
+uint8_t desklamp_get_ticks(void){
+	uint8_t elapsed;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		elapsed = ticks;
+		ticks = 0;
+	}
+	return elapsed;
+}
+
+#if DIAGNOSTICS == 1
+/**
+ *  @brief      Get free-running time
+ *
+ *  Timer0 count extended by the overflows, wraps after 1.4 s.
+ *  @return		time (256 / F_CPU = 21.3 us)
+*/
+uint16_t desklamp_get_time(void){
+	uint8_t high, low;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		low = TCNT0;
+		high = overflows;
+		if (TIFR0 & (1 << TOV0)) {				// overflow not handled yet
+			low = TCNT0;
+			high++;
+		}
+	}
+	return (uint16_t)high << 8 | low;
+}
+#endif
+
+/**
+ *  @brief      Ticks pending?
+ *
+ *  Call with interrupts disabled before going to sleep.
+ *  @return		number of ticks not yet fetched by desklamp_get_ticks()
+*/
+uint8_t desklamp_ticks_pending(void){
+	return ticks;
+}
+
+/**
+ *  @brief      Process one system tick
+*/
+void desklamp_tick(void){
+#if STROBE_BEAT == 1
+	if (beat_ticks < 0xFFFF) {
+		beat_ticks++;
+	}
+#endif
+#if FAILSAFE == 1
+	if (desklamp_standalone()) {
+		host_idle = 0;
+	} else if (host_active && host_timeout && ++host_idle >= host_timeout) {
+		desklamp_host_lost();
+	}
+#endif
+#if POWERON == 1
+	if (poweron_mode == DESKLAMP_POWERON_LAST) {
+		desklamp_save_last_state();
+	}
+#endif
+#if FADE == 1
+	if (fade.step) {
+		fade.pos += fade.step;
+		if (fade.pos >= (1UL << 24)) {			// end of fade
+			fade.step = 0;
+		}
+		desklamp.r = desklamp_fade_value(0);
+		desklamp.g = desklamp_fade_value(1);
+		desklamp.b = desklamp_fade_value(2);
+		desklamp.dimmer = desklamp_fade_value(3);
+		desklamp_update_pwm();
+	}
+#endif
+}
+
+/**
+ *  @brief      Ext USB PINs changed?
+ *
+ *  Called every tick. Reports a change EXTUSB_DEBOUNCE ticks after the
+ *  first edge. The pin-change interrupt is off meanwhile: the PINs carry
+ *  the external device's USB traffic, which would otherwise interrupt at
+ *  the bit rate. Edges during the debounce leave PCIF0 set, so the
+ *  interrupt fires again right away and the PINs are read once more.
+ *  @return		1 = PINs changed, check with desklamp_chk_extusb()
+*/
+uint8_t desklamp_extusb_changed(void){
+	uint8_t changed = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (extusb_debounce && !--extusb_debounce) {
+			GIMSK |= (1 << PCIE0);
+			changed = 1;
+		}
+	}
+	return changed;
 }
 
 /**
@@ -414,4 +1538,56 @@ uint8_t desklamp_chk_extusb(void){
 	}
 }
 
+/**
+ *  @brief      Pin change on Ext USB PINs
+ *
+ *  Starts the debounce time and masks itself until it expires, see
+ *  desklamp_extusb_changed(). Interrupts are enabled again as soon as it
+ *  is masked, it cannot nest while the PINs toggle then.
+*/
+ISR(PCINT0_vect) {
+	GIMSK &= ~(1 << PCIE0);							// until the debounce expires
+	sei();
+	extusb_debounce = EXTUSB_DEBOUNCE;
+}
+
+/**
+ *  @brief      Timer0 overflow: system tick and strobe
+ *
+ *  Interruptible, so the USB interrupt is not delayed. The strobe only
+ *  switches the PWM outputs on and off, the PWM values are prepared by
+ *  desklamp_update_pwm().
+*/
+ISR(TIM0_OVF_vect, ISR_NOBLOCK) {
+	ticks++;
+#if DIAGNOSTICS == 1
+	overflows++;
+#endif
+#if STROBE == 1
+	uint32_t inc = strobe_inc;
+	uint32_t phase = strobe_phase;
+
+	if (inc && !desklamp.usb_ext) {
+#if STROBE_BEAT == 1
+		if (strobe_adjust) {							// beat correction
+			phase -= strobe_error;
+			strobe_adjust = 0;
+		}
+#endif
+		phase += inc;
+		strobe_phase = phase;
+		if (phase < inc) {								// overflow: flash on
+			strobe_flash = 1;
+			strobe_remain = strobe_width;
+			TCCR0A |= strobe_on0;
+			TCCR1A |= strobe_on1;
+		} else if (strobe_flash && !--strobe_remain) {	// flash off
+			strobe_flash = 0;
+			TCCR0A &= ~(1 << COM0B1);
+			TCCR1A &= ~((1 << COM1A1) | (1 << COM1B1));
+		}
+	}
+#endif
+}
+
 /* --------------------------------- End Of File ------------------------------ */
@@ -26,6 +26,8 @@
 #define DESKLAMP_PIN_LED3		PA5
 #define DESKLAMP_PIN_DP_EXT		PA3
 #define DESKLAMP_PIN_DM_EXT		PA2
+#define DESKLAMP_PCINT_DP_EXT	PCINT3
+#define DESKLAMP_PCINT_DM_EXT	PCINT2
 /** @} */
 
 #define LOWBYTE(var)    (((uchar *)&(var))[0])
@@ -33,6 +35,11 @@
 
 /**
  * @name Desklamp Commands
+ *
+ * Report IDs 1..12 carry one command each. The HID report descriptor must
+ * stay below 256 bytes, so the SET commands from 13 on share report
+ * DESKLAMP_CMD_EXTENDED: command ID, then the command data, the same layout
+ * as a report of its own. GET reports keep their own report IDs.
  * @{
  */
 #define DESKLAMP_CMD_SET_LED		1
@@ -42,12 +49,50 @@
 #define DESKLAMP_CMD_SET_STROBE		4
 #define DESKLAMP_CMD_SET_DIMMER		2
 #define DESKLAMP_CMD_SET_SERIAL		10
+#define DESKLAMP_CMD_SET_HSV		13
+#define DESKLAMP_CMD_SET_CCT		15
+#define DESKLAMP_CMD_SET_FADE		17
+#define DESKLAMP_CMD_SET_KEYFRAME	18
+#define DESKLAMP_CMD_PLAY_SEQUENCE	19
+#define DESKLAMP_CMD_SET_PROGRAM	20
+#define DESKLAMP_CMD_RUN_PROGRAM	21
+#define DESKLAMP_CMD_STORE_SCENE	22
+#define DESKLAMP_CMD_RECALL_SCENE	23
+#define DESKLAMP_CMD_SET_POWERON	24
+#define DESKLAMP_CMD_SET_FAILSAFE	25
+#define DESKLAMP_CMD_MACRO			26		// GET: mode, overflow
+#define DESKLAMP_CMD_SET_EFFECT		27
+#define DESKLAMP_CMD_SET_LFO		28
+#define DESKLAMP_CMD_STROBE_BEAT	29
+#define DESKLAMP_CMD_DIAG_LATENCY	30		// GET: statistics, SET: reset
+#define DESKLAMP_CMD_DIAG_PROFILE	31		// GET: counters, SET: reset and probe interrupt load
+#define DESKLAMP_CMD_DIAG_STACK		32		// GET: free RAM and stack use
+#define DESKLAMP_CMD_RESETS			33		// GET: reset cause and counters, SET: clear counters
+#define DESKLAMP_CMD_EXTENDED		64		// SET: command ID 13.. and its data
 
 #define DESKLAMP_CMD_GET_RGB		7
 #define DESKLAMP_CMD_GET_COLORMODE	8
 #define DESKLAMP_CMD_IS_ADAPTER		12
 #define DESKLAMP_CMD_GET_DIMMER		6
 #define DESKLAMP_CMD_GET_EXTUSB		9
+#define DESKLAMP_CMD_GET_HSV		14
+#define DESKLAMP_CMD_GET_CCT		16
+/** @} */
+
+/**
+ * @name EEPROM layout
+ * @{
+ */
+#define SERIAL_EEPROM_STORE			0
+#define COLORMODE_EEPROM_STORE		4
+#define ADAPTER_EEPROM_STORE		5
+#define POWERON_EEPROM_STORE		6		// power-on mode + r, g, b, dimmer
+#define FAILSAFE_EEPROM_STORE		11		// desklamp_failsafe_t
+#define SEQUENCE_EEPROM_STORE		16		// keyframe count + SEQUENCE_LENGTH keyframes
+#define VM_EEPROM_STORE				128		// VM_PROGRAM_SIZE bytes of bytecode
+#define SCENE_EEPROM_STORE			256		// SCENE_COUNT scenes
+#define MACRO_EEPROM_STORE			288		// log length + MACRO_SIZE bytes of log
+#define RESET_EEPROM_STORE			480		// DESKLAMP_RESET_CAUSES reset counters (16 bit)
 /** @} */
 
 /**
@@ -68,10 +113,191 @@
 #define DESKLAMP_COLORMODE_MONO		1
 /** @} */
 
-/** OPTIONS */
+/**
+ * OPTIONS
+ *
+ * The firmware has to fit below the bootloader, the Makefile checks the
+ * size. The defaults fit all variants with a few hundred bytes to spare,
+ * the flash needed by the other options is noted, so enable them with
+ * care, e.g. make VARIANT="-DSTROBE=0 -DDIAGNOSTICS=1".
+ */
+#ifndef COLORMODE
 #define COLORMODE					DESKLAMP_COLORMODE_MONO
+#endif
+#ifndef USBADAPTER
 #define USBADAPTER					1
+#endif
+#ifndef FIXED_VARIANT
+#define FIXED_VARIANT				0		// 1 = COLORMODE and USBADAPTER fixed at compile time
+#endif
+#ifndef STROBE
 #define STROBE						1
+#endif
+#ifndef STROBE_BEAT
+#define STROBE_BEAT					0		// requires STROBE, ~1 KB
+#endif
+#ifndef POWER_LIMIT
+#define POWER_LIMIT					1
+#endif
+#ifndef HSV
+#define HSV							0		// ~350 bytes
+#endif
+#ifndef CCT
+#define CCT							0		// ~500 bytes
+#endif
+#ifndef FADE
+#define FADE						0		// ~950 bytes
+#endif
+#ifndef SEQUENCE
+#define SEQUENCE					0		// requires FADE, ~1.3 KB
+#endif
+#ifndef VM
+#define VM							0		// requires FADE, ~1.8 KB
+#endif
+#ifndef SCENE_COUNT
+#define SCENE_COUNT					0		// number of scene slots, 0 = no scenes, ~300 bytes
+#endif
+#ifndef POWERON
+#define POWERON						0		// ~400 bytes
+#endif
+#ifndef FAILSAFE
+#define FAILSAFE					1
+#endif
+#ifndef MACRO
+#define MACRO						0		// ~1.1 KB
+#endif
+#ifndef EFFECTS
+#define EFFECTS						0		// ~400 bytes
+#endif
+#ifndef LFO
+#define LFO							0		// ~500 bytes
+#endif
+#ifndef RESET_LOG
+#define RESET_LOG					0		// count reset causes in EEPROM, ~250 bytes
+#endif
+#ifndef DIAGNOSTICS
+#define DIAGNOSTICS					0		// diagnostics reports, ~1.3 KB, only fits with STROBE 0
+#endif
+
+/**
+ * @name Reset causes
+ *
+ * Bit numbers in MCUSR, also the index of the reset counters.
+ * The counters need the bootloader built from
+ * micronucleus/configuration/t84_desklamp, which hands MCUSR over in GPIOR0.
+ * Older bootloaders clear MCUSR, the cause is then reported as
+ * DESKLAMP_RESET_UNAVAILABLE and nothing is counted.
+ * @{
+ */
+#define DESKLAMP_RESET_POWERON		PORF
+#define DESKLAMP_RESET_EXTERNAL		EXTRF
+#define DESKLAMP_RESET_BROWNOUT		BORF
+#define DESKLAMP_RESET_WATCHDOG		WDRF
+#define DESKLAMP_RESET_CAUSES		4
+#define DESKLAMP_RESET_UNAVAILABLE	7		// no flag set, every reset sets one
+/** @} */
+
+/**
+ * @name Power budget
+ *
+ * Current drawn by each LED channel at 100% duty and the total current the
+ * LEDs may draw. Keep POWER_BUDGET_MA below USB_CFG_MAX_BUS_POWER minus the
+ * consumption of the controller itself.
+ * @{
+ */
+#define POWER_BUDGET_MA				90
+#define POWER_WEIGHT_R_MA			40
+#define POWER_WEIGHT_G_MA			40
+#define POWER_WEIGHT_B_MA			40
+/** @} */
+
+/**
+ * @name Color temperature range (Kelvin)
+ * @{
+ */
+#define CCT_MIN_KELVIN				1000
+#define CCT_MAX_KELVIN				12000
+/** @} */
+
+/**
+ * @name Power-on modes
+ * @{
+ */
+#define DESKLAMP_POWERON_FULL		0		// full white
+#define DESKLAMP_POWERON_LOOK		1		// stored look
+#define DESKLAMP_POWERON_LAST		2		// last state
+/** @} */
+
+/**
+ * @name Failsafe modes (host lost)
+ *
+ * _SCENE and _BLACKOUT stop sequence, program, macro, effect and LFO
+ * first. The host timeout does not run while a sequence, a program or a
+ * macro replay plays.
+ * @{
+ */
+#define DESKLAMP_FAILSAFE_HOLD		0		// hold last look
+#define DESKLAMP_FAILSAFE_SCENE		1		// fade to failsafe scene
+#define DESKLAMP_FAILSAFE_BLACKOUT	2		// fade to black
+/** @} */
+
+/**
+ * @name Modulation targets (LFO)
+ * @{
+ */
+#define DESKLAMP_MOD_NONE			0
+#define DESKLAMP_MOD_DIMMER			1
+#define DESKLAMP_MOD_HUE			2		// hue of last HSV value, requires HSV
+#define DESKLAMP_MOD_RED			3
+#define DESKLAMP_MOD_GREEN			4
+#define DESKLAMP_MOD_BLUE			5
+/** @} */
+
+/** Last state is saved when it was unchanged for this time (ms) */
+#define POWERON_SAVE_DELAY			5000
+
+/**
+ * @name Variant
+ *
+ * Fixed variants (see Makefile targets rgb and mono_adapter) replace the
+ * runtime colormode and adapter settings by constants, so the branches
+ * of the other variant are removed by the compiler.
+ * @{
+ */
+#if FIXED_VARIANT == 1
+#define DESKLAMP_IS_RGB()			(COLORMODE == DESKLAMP_COLORMODE_RGB)
+#define DESKLAMP_IS_ADAPTER()		(USBADAPTER)
+#else
+#define DESKLAMP_IS_RGB()			(desklamp_get_colormode() == DESKLAMP_COLORMODE_RGB)
+#define DESKLAMP_IS_ADAPTER()		(desklamp_is_adapter())
+#endif
+/** @} */
+
+/**
+ * @name System tick
+ *
+ * The tick is the Timer0 overflow (F_CPU / 256 / 256 = 183.1 Hz at 12 MHz).
+ * @{
+ */
+#define DESKLAMP_MS_TO_TICKS(ms)	(((uint32_t)(ms) * (F_CPU / 32000UL)) >> 11)
+#define DESKLAMP_TICK_CHZ			(F_CPU * 100UL / 65536)		// tick frequency (0.01 Hz)
+#define EXTUSB_DEBOUNCE				10		// ticks the ext USB PINs must be stable
+/** @} */
+
+/**
+ * @name Strobe
+ *
+ * The strobe is a phase accumulator (32 bit) advanced every tick, a flash
+ * starts when it overflows. The increments are rounded: at 12 MHz the
+ * rate is 2 ppm off (234562 per 0.01 Hz), from a tempo 100 ppm (3909 per
+ * 0.01 BPM), which the beat PLL trims away.
+ * @{
+ */
+#define STROBE_MAX_CHZ				9000	// max. frequency (0.01 Hz), below half the tick rate
+#define STROBE_INC_PER_CHZ			((uint32_t)(281474976710656.0 / 100 / F_CPU + 0.5))
+#define STROBE_INC_PER_CBPM			((uint32_t)(281474976710656.0 / 6000 / F_CPU + 0.5))
+#define STROBE_BEAT_TIMEOUT			8000	// beats further apart (ms) only set the phase
+/** @} */
 
 enum {OFF, ON};				// Values for OFF = 0 , ON = 1
 enum {DISABLE, ENABLE};		// Values for DISABLE = 0 , ENABLE = 1
@@ -80,18 +306,67 @@ enum {DISABLE, ENABLE};		// Values for DISABLE = 0 , ENABLE = 1
 /** Typdef for the desklamp structure */
 typedef struct {
 	uint8_t state;
+#if FIXED_VARIANT == 0
 	uint8_t colormode;		/** colormode: RGB or Single Color */
+#endif
 	uint8_t r;				/** red */
 	uint8_t g;				/** green */
 	uint8_t b;				/** blue */
 	uint8_t dimmer;			/** dimmer */
-	uint8_t strobe;			/** strobe value */
+#if HSV == 1
+	uint16_t hue;			/** hue of last HSV value (0..65535 = 0..360 deg) */
+	uint8_t sat;			/** saturation of last HSV value */
+	uint8_t val;			/** value of last HSV value */
+#endif
+#if CCT == 1
+	uint16_t kelvin;		/** color temperature of last CCT value */
+	int8_t tint;			/** green (+) / magenta (-) shift of last CCT value */
+#endif
+	uint16_t strobe;		/** strobe frequency (0.01 Hz) */
 	uint8_t blackout;
+#if EFFECTS == 1
+	uint8_t effect;			/** effect level, scales dimmer (255 = no effect) */
+#endif
+#if LFO == 1
+	uint8_t mod_target;		/** modulation target */
+	int16_t mod;			/** modulation: hue offset or scale of target (255 = none) */
+#endif
 	uint8_t usb_ext;		/** ext USB check */
 	uint32_t serial;
+#if FIXED_VARIANT == 0
 	uint8_t isAdapter;
+#endif
 }desklamp_t;
 
+/** Typdef for a stored scene */
+typedef struct {
+	uint8_t r;				/** red */
+	uint8_t g;				/** green */
+	uint8_t b;				/** blue */
+	uint8_t dimmer;			/** dimmer */
+	uint16_t strobe;		/** strobe frequency (0.01 Hz) */
+}desklamp_scene_t;
+
+/** Typdef for the failsafe configuration */
+typedef struct {
+	uint8_t mode;			/** failsafe mode */
+	uint8_t timeout;		/** host timeout (s), 0 = bus reset only */
+	uint8_t scene;			/** scene for DESKLAMP_FAILSAFE_SCENE */
+	uint16_t time;			/** fade time (ms) */
+}desklamp_failsafe_t;
+
+#if FADE == 1
+/** Typdef for a running fade */
+typedef struct {
+	uint8_t from[4];		/** r, g, b, dimmer at start of fade */
+	uint8_t to[4];			/** r, g, b, dimmer at end of fade */
+	uint16_t light_from[3];	/** linear light of channel 1..3 at start of fade */
+	uint16_t light_to[3];	/** linear light of channel 1..3 at end of fade */
+	uint32_t pos;			/** position (8.24 fixed point, 1.0 = end) */
+	uint32_t step;			/** position increment per tick, 0 = no fade */
+}desklamp_fade_t;
+#endif
+
 
 void desklamp_init(void);
 void desklamp_config_channel(uint8_t channel, uint8_t state);
@@ -101,11 +376,27 @@ void desklamp_set_led(uint8_t led, uint8_t onoff);
 void desklamp_set_led_intensity(uint8_t led, uint8_t intensity);
 void desklamp_set_rgb(uint8_t r, uint8_t g, uint8_t b);
 void desklamp_set_dimmer(uint8_t dimmer);
+void desklamp_fade(uint8_t r, uint8_t g, uint8_t b, uint8_t dimmer, uint16_t time);
+uint8_t desklamp_is_fading(void);
+void desklamp_store_scene(uint8_t scene);
+void desklamp_recall_scene(uint8_t scene, uint16_t time);
+void desklamp_set_poweron(uint8_t mode, uint8_t r, uint8_t g, uint8_t b, uint8_t dimmer);
+void desklamp_set_failsafe(uint8_t mode, uint8_t timeout, uint8_t scene, uint16_t time);
+void desklamp_host_active(void);
+void desklamp_host_lost(void);
+void desklamp_clear_reset_counts(void);
+void desklamp_set_hsv(uint16_t hue, uint8_t sat, uint8_t val);
+void desklamp_set_cct(uint16_t kelvin, int8_t tint);
 void desklamp_set_colormode(uint8_t colormode);
 void desklamp_set_adapter(uint8_t isAdapter);
 void desklamp_set_serial(uint32_t serial);
-void desklamp_set_strobe(uint8_t strobe);
+void desklamp_set_strobe(uint16_t freq);
+void desklamp_set_strobe_legacy(uint8_t strobe);
+void desklamp_set_strobe_flash(uint16_t ms, uint8_t duty, uint8_t intensity);
+void desklamp_strobe_beat(uint16_t bpm, uint8_t sub);
 void desklamp_set_blackout(uint8_t blackout);
+void desklamp_set_effect_level(uint8_t level);
+void desklamp_set_modulation(uint8_t target, int16_t mod);
 void desklamp_set_state(uint8_t state);
 uint8_t desklamp_get_state(void);
 uint8_t desklamp_get_colormode(void);
@@ -114,8 +405,17 @@ uint32_t desklamp_get_serial(void);
 uint8_t desklamp_get_rgb(char c);
 uint8_t desklamp_get_dimmer(void);
 uint16_t desklamp_get_hsv(char c);
-uint8_t desklamp_get_strobe(void);
+uint16_t desklamp_get_cct(void);
+int8_t desklamp_get_tint(void);
+uint8_t desklamp_get_reset_cause(void);
+uint16_t desklamp_get_reset_count(uint8_t cause);
+uint16_t desklamp_get_strobe(void);
+uint8_t desklamp_extusb_changed(void);
 uint8_t desklamp_chk_extusb(void);
+uint8_t desklamp_get_ticks(void);
+uint8_t desklamp_ticks_pending(void);
+uint16_t desklamp_get_time(void);
+void desklamp_tick(void);
 
 #endif /* __DESKLAMP_H */
 
@@ -0,0 +1,301 @@
+/**
+ * @file 	diag.c
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Diagnostics
+ *
+ * Command-to-light latency: time from a complete SET report in
+ * usbFunctionWrite() to the next write of the PWM registers in
+ * desklamp_update_pwm(). Commands that do not change the output are
+ * measured up to the next change from any source (e.g. fade, LFO).
+ *
+ * Times are in units of desklamp_get_time() (256 / F_CPU = 21.3 us).
+ * Histogram bucket 0 counts latencies below 8 units, bucket n
+ * latencies of 2^(n+2)..2^(n+3)-1 units, the last bucket everything above.
+ *
+ * Profiling: main loop iterations per second, worst-case duration of
+ * one loop iteration (without sleep) and the time spent in usbPoll()
+ * and blocked in EEPROM writes (DIAG_PROFILE()). Interrupts cannot be
+ * timed from inside, the V-USB interrupt is plain assembler. Instead,
+ * after a reset of the profiling counters (SET report), the main loop
+ * busy-waits once for DIAG_PROBE_UNITS and counts how much longer the
+ * wait took; the difference is the time the interrupts took away. The
+ * probe blocks usbPoll() for one tick, it does not run otherwise.
+ *
+ * Stack: the RAM between the end of .bss and the top of the stack is
+ * painted with DIAG_STACK_PAINT before main() runs. The deepest stack
+ * use is the lowest byte no longer holding the pattern. There is no
+ * heap, so everything below that is free.
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/delay_basic.h>
+#include "desklamp.h"
+#include "diag.h"
+
+#if DIAGNOSTICS == 1
+
+extern uint8_t _end;						/** end of .bss (linker) */
+extern uint8_t __stack;						/** top of the stack (linker) */
+
+static uint16_t received;					/** time of last command */
+static uint8_t pending;						/** 1 = command waits for output */
+static uint16_t latency_min;
+static uint16_t latency_max;
+static uint32_t latency_sum;
+static uint16_t latency_count;
+static uint8_t histogram[DIAG_LATENCY_BUCKETS];
+
+static uint16_t loop_start;
+static uint16_t loop_count;					/** iterations in this second */
+static uint16_t loops_per_second;
+static uint16_t loop_max;
+static uint16_t seconds;					/** since reset, counters stop at 0xFFFF */
+static uint8_t probe;						/** 1 = probe due, set by diag_reset_profile() */
+static uint32_t profile[DIAG_PROFILE_COUNT];
+static uint32_t isr_time;
+
+/**
+ *  @brief      Paint the unused RAM, runs before the stack is in use
+ *
+ *  Plain assembler: r1 is not cleared yet in .init1.
+*/
+void diag_paint_stack(void) __attribute__ ((naked, used, section (".init1")));
+void diag_paint_stack(void){
+	__asm__ __volatile__ (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (DIAG_STACK_PAINT));
+}
+
+/**
+ *  @brief      Init diagnostics
+*/
+void diag_init(void){
+	diag_reset_latency();
+	diag_reset_profile();
+	probe = 0;									// on request only
+}
+
+/**
+ *  @brief      Command received from host
+*/
+void diag_command_received(void){
+	received = desklamp_get_time();
+	pending = 1;
+}
+
+/**
+ *  @brief      New values written to the PWM registers
+*/
+void diag_output_latched(void){
+	uint16_t latency, l;
+	uint8_t bucket = 0;
+
+	if (!pending) {
+		return;
+	}
+	pending = 0;
+	latency = desklamp_get_time() - received;
+
+	if (latency_count == 0xFFFF) {				// keep the average valid
+		return;
+	}
+	latency_count++;
+	latency_sum += latency;
+	if (latency < latency_min) {
+		latency_min = latency;
+	}
+	if (latency > latency_max) {
+		latency_max = latency;
+	}
+
+	for (l = latency >> 3; l && bucket < DIAG_LATENCY_BUCKETS - 1; l >>= 1) {
+		bucket++;
+	}
+	if (histogram[bucket] < 0xFF) {
+		histogram[bucket]++;
+	}
+}
+
+/**
+ *  @brief      Reset latency statistics
+*/
+void diag_reset_latency(void){
+	uint8_t i;
+
+	pending = 0;
+	latency_min = 0xFFFF;
+	latency_max = 0;
+	latency_sum = 0;
+	latency_count = 0;
+	for (i = 0; i < DIAG_LATENCY_BUCKETS; i++) {
+		histogram[i] = 0;
+	}
+}
+
+/**
+ *  @brief      Latency report
+ *
+ *  min, avg, max, count (big-endian), histogram. min is 0xFFFF and avg
+ *  is 0 while nothing was measured.
+ *  @param    	report buffer for report data (DIAG_REPORT_SIZE bytes)
+ *  @return		report length
+*/
+uint8_t diag_get_latency(uint8_t *report){
+	uint16_t avg = latency_count ? latency_sum / latency_count : 0;
+	uint8_t i;
+
+	report[0] = latency_min >> 8;
+	report[1] = latency_min;
+	report[2] = avg >> 8;
+	report[3] = avg;
+	report[4] = latency_max >> 8;
+	report[5] = latency_max;
+	report[6] = latency_count >> 8;
+	report[7] = latency_count;
+	for (i = 0; i < DIAG_LATENCY_BUCKETS; i++) {
+		report[8 + i] = histogram[i];
+	}
+	return 8 + DIAG_LATENCY_BUCKETS;
+}
+
+/**
+ *  @brief      Main loop iteration starts
+*/
+void diag_loop_begin(void){
+	loop_start = desklamp_get_time();
+}
+
+/**
+ *  @brief      Main loop iteration done, the CPU goes to sleep
+*/
+void diag_loop_end(void){
+	uint16_t now, duration;
+
+	duration = desklamp_get_time() - loop_start;
+	if (duration > loop_max) {
+		loop_max = duration;
+	}
+	if (loop_count < 0xFFFF) {
+		loop_count++;
+	}
+
+	if (probe) {								// outside of the loop duration
+		probe = 0;
+		loop_start = desklamp_get_time();
+		while ((now = desklamp_get_time()) == loop_start);	// start on a timer step
+		_delay_loop_2(DIAG_PROBE_UNITS * 256UL / 4);
+		isr_time = desklamp_get_time() - now - DIAG_PROBE_UNITS;
+	}
+}
+
+/**
+ *  @brief      Add to a profiling counter
+ *  @param    	counter DIAG_PROFILE_*
+ *  @param    	start desklamp_get_time() before the profiled code
+*/
+void diag_profile_add(uint8_t counter, uint16_t start){
+	uint16_t duration = desklamp_get_time() - start;
+
+	if (seconds < 0xFFFF) {
+		profile[counter] += duration;
+	}
+}
+
+/**
+ *  @brief      Diagnostics task, runs once per second
+*/
+void diag_tick(void){
+	loops_per_second = loop_count;
+	loop_count = 0;
+	if (seconds < 0xFFFF) {
+		seconds++;
+	}
+}
+
+/**
+ *  @brief      Reset profiling counters
+*/
+void diag_reset_profile(void){
+	uint8_t i;
+
+	loop_max = 0;
+	seconds = 0;
+	isr_time = 0;
+	probe = 1;
+	for (i = 0; i < DIAG_PROFILE_COUNT; i++) {
+		profile[i] = 0;
+	}
+}
+
+/**
+ *  @brief      Profiling report
+ *
+ *  loops per second, worst loop duration, seconds since reset (16 bit),
+ *  time in usbPoll(), time blocked in EEPROM writes, time taken by
+ *  interrupts during the probe (32 bit), all big-endian. The interrupt
+ *  load is interrupts / DIAG_PROBE_UNITS.
+ *  @param    	report buffer for report data (DIAG_REPORT_SIZE bytes)
+ *  @return		report length
+*/
+uint8_t diag_get_profile(uint8_t *report){
+	uint32_t values[3] = {profile[DIAG_PROFILE_USBPOLL], profile[DIAG_PROFILE_EEPROM], isr_time};
+	uint8_t i;
+
+	report[0] = loops_per_second >> 8;
+	report[1] = loops_per_second;
+	report[2] = loop_max >> 8;
+	report[3] = loop_max;
+	report[4] = seconds >> 8;
+	report[5] = seconds;
+	for (i = 0; i < 3; i++) {
+		report[6 + i * 4] = values[i] >> 24;
+		report[7 + i * 4] = values[i] >> 16;
+		report[8 + i * 4] = values[i] >> 8;
+		report[9 + i * 4] = values[i];
+	}
+	return 18;
+}
+
+/**
+ *  @brief      Stack report
+ *
+ *  free RAM, deepest stack use, static RAM (.data and .bss), bytes,
+ *  big-endian. The free RAM is a lower bound, the painted area only
+ *  shrinks.
+ *  @param    	report buffer for report data (DIAG_REPORT_SIZE bytes)
+ *  @return		report length
+*/
+uint8_t diag_get_stack(uint8_t *report){
+	uint8_t *p = &_end;
+	uint16_t unused, used, data;
+
+	while (p <= &__stack && *p == DIAG_STACK_PAINT) {
+		p++;
+	}
+	unused = p - &_end;
+	used = &__stack - p + 1;
+	data = &_end - (uint8_t *)RAMSTART;
+
+	report[0] = unused >> 8;
+	report[1] = unused;
+	report[2] = used >> 8;
+	report[3] = used;
+	report[4] = data >> 8;
+	report[5] = data;
+	return 6;
+}
+
+#endif
+
+/* --------------------------------- End Of File ------------------------------ */
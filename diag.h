@@ -0,0 +1,53 @@
+/**
+ * @file 	diag.h
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Diagnostics
+ *
+ */
+
+#ifndef __DIAG_H
+#define __DIAG_H
+
+#include <stdint.h>
+
+/** Size of the largest diagnostics report (bytes, without report ID) */
+#define DIAG_REPORT_SIZE			18
+
+/** Number of latency histogram buckets */
+#define DIAG_LATENCY_BUCKETS		8
+
+/** Profiling counters */
+#define DIAG_PROFILE_USBPOLL		0
+#define DIAG_PROFILE_EEPROM			1
+#define DIAG_PROFILE_COUNT			2
+
+/** Length of the interrupt probe window (units of desklamp_get_time(), one system tick) */
+#define DIAG_PROBE_UNITS			256
+
+/** Fill pattern of unused RAM */
+#define DIAG_STACK_PAINT			0xC5
+
+/** Add the run time of a statement to a profiling counter */
+#if DIAGNOSTICS == 1
+#define DIAG_PROFILE(counter, statement)	do { uint16_t diag_start = desklamp_get_time(); statement; diag_profile_add(counter, diag_start); } while (0)
+#else
+#define DIAG_PROFILE(counter, statement)	statement
+#endif
+
+void diag_init(void);
+void diag_command_received(void);
+void diag_output_latched(void);
+void diag_reset_latency(void);
+uint8_t diag_get_latency(uint8_t *report);
+void diag_loop_begin(void);
+void diag_loop_end(void);
+void diag_profile_add(uint8_t counter, uint16_t start);
+void diag_tick(void);
+void diag_reset_profile(void);
+uint8_t diag_get_profile(uint8_t *report);
+uint8_t diag_get_stack(uint8_t *report);
+
+#endif /* __DIAG_H */
+
+/* --------------------------------- End Of File ------------------------------ */
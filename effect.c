@@ -0,0 +1,106 @@
+/**
+ * @file 	effect.c
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Random effects
+ *
+ * Candle flicker, lightning and random strobe modulate the dimmer through
+ * desklamp_set_effect_level(), so they work on top of any color, fade or
+ * sequence. All effects use the fast PRNG from entropy.c, which is
+ * reseeded from the entropy pool whenever an effect is started. The
+ * pool collects watchdog jitter all the time, including while USB is
+ * active, and has a new value about every 0.5 s.
+ *
+ * intensity: depth of the effect, the level between flashes or the
+ *            lowest flicker level is 255 - intensity
+ * rate:      speed of the effect, higher is faster
+ */
+
+#include <stdint.h>
+#include "desklamp.h"
+#include "entropy.h"
+#include "effect.h"
+
+#if EFFECTS == 1
+
+static uint8_t effect;
+static uint8_t intensity;
+static uint8_t rate;
+static uint8_t level;				/** current effect level */
+static uint8_t target;				/** flicker target level */
+static uint8_t flashes;				/** remaining flashes of lightning */
+static uint16_t countdown;			/** ticks until next change */
+
+/**
+ *  @brief      Start effect
+ *  @param    	neweffect (EFFECT_NONE, EFFECT_CANDLE, EFFECT_LIGHTNING, EFFECT_RANDOM_STROBE)
+ *  @param    	newintensity (0..255)
+ *  @param    	newrate (0..255)
+*/
+void effect_set(uint8_t neweffect, uint8_t newintensity, uint8_t newrate){
+	if (entropy_available()) {
+		entropy_seed(entropy_random());
+	}
+	effect = neweffect;
+	intensity = newintensity;
+	rate = newrate;
+	level = 255;
+	target = 255;
+	flashes = 0;
+	countdown = 1;
+	desklamp_set_effect_level(255);
+}
+
+/**
+ *  @brief      Random value
+ *  @param    	max (0..255)
+ *  @return		0..max
+*/
+static uint8_t effect_random(uint8_t max){
+	return ((uint16_t)entropy_prng() * (max + 1)) >> 8;
+}
+
+/**
+ *  @brief      Process one system tick
+*/
+void effect_tick(void){
+	uint8_t ambient = 255 - intensity;
+
+	switch (effect) {
+		case EFFECT_CANDLE:
+			if (!--countdown) {
+				target = 255 - effect_random(intensity);
+				countdown = 1 + ((255 - rate) >> 5) + effect_random(3);
+			}
+			level += ((int16_t)target - level) >> 2;		// smooth flicker
+			break;
+
+		case EFFECT_LIGHTNING:
+			if (!--countdown) {
+				if (level != ambient) {						// end of flash
+					level = ambient;
+					countdown = 2 + effect_random(6);
+				} else if (flashes) {						// next flash of burst
+					flashes--;
+					level = 255;
+					countdown = 1 + effect_random(1);
+				} else {									// next burst
+					flashes = 1 + effect_random(3);
+					countdown = 1 + (((uint16_t)(256 - rate) * effect_random(255)) >> 4);
+				}
+			}
+			break;
+
+		case EFFECT_RANDOM_STROBE:
+			level = effect_random(255) < rate ? 255 : ambient;
+			break;
+
+		default:
+			return;
+	}
+	desklamp_set_effect_level(level);
+}
+
+#endif
+
+/* --------------------------------- End Of File ------------------------------ */
@@ -0,0 +1,29 @@
+/**
+ * @file 	effect.h
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Random effects
+ *
+ */
+
+#ifndef __EFFECT_H
+#define __EFFECT_H
+
+#include <stdint.h>
+
+/**
+ * @name Effects
+ * @{
+ */
+#define EFFECT_NONE					0
+#define EFFECT_CANDLE				1
+#define EFFECT_LIGHTNING			2
+#define EFFECT_RANDOM_STROBE		3
+/** @} */
+
+void effect_set(uint8_t effect, uint8_t intensity, uint8_t rate);
+void effect_tick(void);
+
+#endif /* __EFFECT_H */
+
+/* --------------------------------- End Of File ------------------------------ */
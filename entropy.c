@@ -8,56 +8,117 @@
 #include "entropy.h"
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
+#include <util/atomic.h>
 
-#define WDT_BUFFER_SIZE	32
+#define WDT_BUFFER_SIZE	32		// samples per 32-bit value
 
-volatile uint8_t gWDT_pool_count;
-volatile uint32_t gWDT_entropy_pool;
-uint8_t gWDT_buffer_position;
+uint8_t gWDT_pool_count;
+uint32_t gWDT_entropy_pool;
+uint32_t gWDT_hash;
+uint8_t gWDT_hash_count;
+volatile uint8_t gWDT_sample;
+volatile uint8_t gWDT_sample_ready;
+uint16_t gPRNG_state = 1;
 
+// Arm one sample: interrupt and system reset mode with the shortest period
+// (16ms). The interrupt takes the sample and goes back to wdt_enable(WDTO_1S).
+static void entropy_arm(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		wdt_reset();
+		_WD_CONTROL_REG = _BV(_WD_CHANGE_BIT) | _BV(WDE);
+		_WD_CONTROL_REG = _BV(WDIE) | _BV(WDE); // Watchdog system reset (WDE) enable and the Watchdog interrupt enable (WDIE)
+	}
+}
+
+// The watchdog runs as wdt_enable(WDTO_1S), which resets the MCU even with
+// interrupts disabled. Only while the pool is filled, entropy_tick() arms
+// one sample at a time. A hang during that 16ms with interrupts disabled is
+// not caught, the pool is full after 32 samples and stays so until
+// entropy_random() takes it. Interrupts are enabled on return.
 void entropy_init(void) {
-	gWDT_buffer_position = 0;
+	gWDT_hash_count = 0;
 	gWDT_pool_count = 0;
 	cli(); // Temporarily turn off interrupts, until WDT configured
-	MCUSR = 0; // Use the MCU status register to reset flags for WDR, BOR, EXTR, and POWR
-	_WD_CONTROL_REG |= (1 << _WD_CHANGE_BIT) | (1 << WDE);
-	// WDTCSR |= _BV(WDCE) | _BV(WDE);// WDT control register, This sets the Watchdog Change Enable (WDCE) flag, which is  needed to set the
-	_WD_CONTROL_REG = _BV(WDIE); // Watchdog system reset (WDE) enable and the Watchdog interrupt enable (WDIE)
-	TCCR1B = (1 << CS10);					// prescaler 1
+	MCUSR = 0; // Clear WDRF, the reset cause is saved before (desklamp_save_reset_cause())
+	entropy_arm();
+	TCCR1B |= (1 << CS10);					// prescaler 1, until the PWM sets its own
 	sei(); // Turn interupts on
 }
 
+// Keep the watchdog from resetting the MCU, use instead of wdt_reset().
+// Not while a sample is armed, it would never be taken.
+void entropy_wdt_reset(void) {
+	if (!(_WD_CONTROL_REG & _BV(WDIE))) {
+		wdt_reset();
+	}
+}
+
+// Mix the last sample into the pool, one step of Jenkin's one at a time hash,
+// and arm the next sample until the pool is full.
+// Called from the main loop on every tick, which is faster than the samples.
+// This hash function has had preliminary testing to verify that it
+// produces reasonably uniform random results when using WDT jitter
+// on a variety of Arduino platforms
+void entropy_tick(void) {
+	if (!gWDT_sample_ready) {
+		if (!gWDT_pool_count && !(_WD_CONTROL_REG & _BV(WDIE))) {
+			entropy_arm();
+		}
+		return;
+	}
+	gWDT_hash += gWDT_sample;
+	gWDT_sample_ready = 0;
+	gWDT_hash += (gWDT_hash << 10);
+	gWDT_hash ^= (gWDT_hash >> 6);
+
+	if (++gWDT_hash_count >= WDT_BUFFER_SIZE) {
+		gWDT_hash += (gWDT_hash << 3);
+		gWDT_hash ^= (gWDT_hash >> 11);
+		gWDT_hash += (gWDT_hash << 15);
+		gWDT_entropy_pool = gWDT_hash;
+		gWDT_hash_count = 0; // Start collecting the next 32 samples of Timer 1 counts
+		gWDT_pool_count = 1;
+	}
+}
+
 uint32_t entropy_random(void) {
-	while (gWDT_pool_count < 1);
+	while (gWDT_pool_count < 1) { // only at first boot, before the main loop runs
+		entropy_wdt_reset();
+		entropy_tick();
+	}
 
 	gWDT_pool_count = 0;
 	return gWDT_entropy_pool;
 }
 
-// This interrupt service routine is called every time the WDT interrupt is triggered.
-// With the default configuration that is approximately once every 16ms, producing
-// approximately two 32-bit integer values every second.
-//
-// The pool is implemented as an 8 value circular buffer
-ISR(WDT_vect) {
-	static uint8_t gWDT_buffer[WDT_BUFFER_SIZE];
-
-	gWDT_buffer[gWDT_buffer_position] = TCNT1L; // Record the Timer 1 low byte (only one needed)
-	gWDT_buffer_position++; // every time the WDT interrupt is triggered
-	if (gWDT_buffer_position >= WDT_BUFFER_SIZE) {
-		// The following code is an implementation of Jenkin's one at a time hash
-		// This hash function has had preliminary testing to verify that it
-		// produces reasonably uniform random results when using WDT jitter
-		// on a variety of Arduino platforms
-		for (uint8_t i = 0; i < WDT_BUFFER_SIZE; ++i) {
-			gWDT_entropy_pool += gWDT_buffer[i];
-			gWDT_entropy_pool += (gWDT_entropy_pool << 10);
-			gWDT_entropy_pool ^= (gWDT_entropy_pool >> 6);
-		}
-		gWDT_entropy_pool += (gWDT_entropy_pool << 3);
-		gWDT_entropy_pool ^= (gWDT_entropy_pool >> 11);
-		gWDT_entropy_pool += (gWDT_entropy_pool << 15);
-		gWDT_buffer_position = 0; // Start collecting the next 32 bytes of Timer 1 counts
-		gWDT_pool_count = 1;
+// Returns 1 if entropy_random() would return without waiting
+uint8_t entropy_available(void) {
+	return gWDT_pool_count;
+}
+
+// Seed the pseudo random generator, a seed of 0 is ignored
+void entropy_seed(uint16_t seed) {
+	if (seed) {
+		gPRNG_state = seed;
 	}
 }
+
+// Fast pseudo random byte (16 bit xorshift, period 65535) for effects.
+// Not suitable for serial numbers, use entropy_random() for these.
+uint8_t entropy_prng(void) {
+	gPRNG_state ^= gPRNG_state << 7;
+	gPRNG_state ^= gPRNG_state >> 9;
+	gPRNG_state ^= gPRNG_state << 8;
+	return gPRNG_state;
+}
+
+// This interrupt service routine is called 16ms after entropy_arm(), producing
+// a 32-bit value about every 0.6s while the pool is filled.
+//
+// Only the sample is taken here, entropy_tick() does the hashing. The interrupt
+// does not block the V-USB interrupt.
+ISR(WDT_vect, ISR_NOBLOCK) {
+	gWDT_sample = TCNT1L; // Record the Timer 1 low byte (only one needed)
+	gWDT_sample_ready = 1;
+	wdt_enable(WDTO_1S); // WDIE is cleared by hardware, back to system reset mode
+}
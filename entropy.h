@@ -11,6 +11,11 @@
 #include <stdint.h>
 
 void entropy_init(void);
+void entropy_wdt_reset(void);
+void entropy_tick(void);
 uint32_t entropy_random(void);
+uint8_t entropy_available(void);
+void entropy_seed(uint16_t seed);
+uint8_t entropy_prng(void);
 
 #endif /* ENTROPY_H_ */
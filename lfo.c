@@ -0,0 +1,111 @@
+/**
+ * @file 	lfo.c
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Low frequency oscillator
+ *
+ * The LFO runs on the system tick and passes its output to
+ * desklamp_set_modulation(), which applies it to the dimmer, the hue of
+ * the last HSV value or a single channel in desklamp_update_pwm(). The
+ * color set by the host is not changed.
+ *
+ * rate:   frequency in 0.01 Hz
+ * depth:  0 = no modulation, 255 = full range (dimmer, channels: 0..100%,
+ *         hue: +-180 deg)
+ * phase:  phase offset (0..255 = 0..360 deg), lamps started together with
+ *         staggered phases run as a chase
+ */
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+#include "desklamp.h"
+#include "lfo.h"
+
+#if LFO == 1
+
+/** first quarter of cosine, 0..64 = 0..90 deg */
+const PROGMEM uint8_t lfotable[65] = {
+		255, 255, 255, 255, 254, 254, 254, 253, 253, 252,
+		251, 250, 250, 249, 248, 246, 245, 244, 243, 241,
+		240, 238, 237, 235, 234, 232, 230, 228, 226, 224,
+		222, 220, 218, 215, 213, 211, 208, 206, 203, 201,
+		198, 196, 193, 190, 188, 185, 182, 179, 176, 173,
+		170, 167, 165, 162, 158, 155, 152, 149, 146, 143,
+		140, 137, 134, 131, 128
+};
+
+static uint8_t target;
+static uint8_t waveform;
+static uint8_t depth;
+static uint8_t offset;				/** phase offset */
+static uint32_t phase;				/** phase accumulator (24 bit) */
+static uint32_t increment;			/** phase increment per tick */
+
+/**
+ *  @brief      Start LFO
+ *  @param    	newtarget (DESKLAMP_MOD_NONE, _DIMMER, _HUE, _RED, _GREEN, _BLUE)
+ *  @param    	newwaveform (LFO_SINE, LFO_TRIANGLE, LFO_SQUARE, LFO_SAW)
+ *  @param    	rate frequency (0.01 Hz)
+ *  @param    	newdepth (0..255)
+ *  @param    	newphase phase offset (0..255)
+*/
+void lfo_set(uint8_t newtarget, uint8_t newwaveform, uint16_t rate, uint8_t newdepth, uint8_t newphase){
+	target = newtarget;
+	waveform = newwaveform;
+	depth = newdepth;
+	offset = newphase;
+	phase = 0;
+	increment = (uint32_t)rate * LFO_INC_PER_CHZ;
+	if (target == DESKLAMP_MOD_NONE) {
+		desklamp_set_modulation(DESKLAMP_MOD_NONE, 0);
+	}
+}
+
+/**
+ *  @brief      Waveform value
+ *  @param    	pos position (0..255 = 0..360 deg)
+ *  @return		0..255
+*/
+static uint8_t lfo_wave(uint8_t pos){
+	switch (waveform) {
+		case LFO_TRIANGLE:
+			return pos < 128 ? 255 - (pos << 1) : ((pos - 128) << 1) + 1;
+		case LFO_SQUARE:
+			return pos < 128 ? 255 : 0;
+		case LFO_SAW:
+			return 255 - pos;
+		default:	// LFO_SINE
+			if (pos <= 64) {
+				return pgm_read_byte(&(lfotable[pos]));
+			} else if (pos <= 128) {
+				return 255 - pgm_read_byte(&(lfotable[128 - pos]));
+			} else if (pos <= 192) {
+				return 255 - pgm_read_byte(&(lfotable[pos - 128]));
+			}
+			return pgm_read_byte(&(lfotable[(uint8_t)-pos]));
+	}
+}
+
+/**
+ *  @brief      Process one system tick
+*/
+void lfo_tick(void){
+	uint8_t w;
+
+	if (target == DESKLAMP_MOD_NONE) {
+		return;
+	}
+	phase += increment;
+	w = lfo_wave((uint8_t)(phase >> 16) + offset);
+
+	if (target == DESKLAMP_MOD_HUE) {
+		desklamp_set_modulation(target, ((int16_t)w - 128) * depth);
+	} else {
+		w = 255 - w;
+		desklamp_set_modulation(target, 255 - (((uint16_t)w * depth + w) >> 8));
+	}
+}
+
+#endif
+
+/* --------------------------------- End Of File ------------------------------ */
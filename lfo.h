@@ -0,0 +1,34 @@
+/**
+ * @file 	lfo.h
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Low frequency oscillator
+ *
+ */
+
+#ifndef __LFO_H
+#define __LFO_H
+
+#include <stdint.h>
+
+/**
+ * @name Waveforms
+ *
+ * All waveforms start at their maximum at phase 0.
+ * @{
+ */
+#define LFO_SINE					0
+#define LFO_TRIANGLE				1
+#define LFO_SQUARE					2
+#define LFO_SAW						3		// falling ramp
+/** @} */
+
+/** Phase increment (24 bit phase) per tick for 0.01 Hz */
+#define LFO_INC_PER_CHZ				((uint16_t)(1099511627776.0 / 100 / F_CPU + 0.5))
+
+void lfo_set(uint8_t target, uint8_t waveform, uint16_t rate, uint8_t depth, uint8_t phase);
+void lfo_tick(void);
+
+#endif /* __LFO_H */
+
+/* --------------------------------- End Of File ------------------------------ */
@@ -0,0 +1,275 @@
+/**
+ * @file 	macro.c
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Macro recorder for host commands
+ *
+ * While recording, every light command is logged with the number of system
+ * ticks since the previous one. Commands that write to EEPROM themselves
+ * (serial, scenes, programs, settings) are not logged, a replay loop would
+ * wear out the EEPROM. Entries are collected in an SRAM ring buffer and
+ * macro_poll() writes them to EEPROM whenever it is ready, so recording
+ * does not block usbPoll(). If the ring buffer or the log is full,
+ * recording stops and macro_get_overflow() reports it. Replay returns the
+ * logged reports with their original timing through macro_next().
+ *
+ * Log entry: delta ticks, report ID, data length, report data.
+ * Gaps longer than 255 ticks are stored as pause entries (report ID 0).
+ */
+
+#include <avr/eeprom.h>
+#include "desklamp.h"
+#include "macro.h"
+#include "diag.h"
+
+#if MACRO == 1
+
+#define MACRO_LENGTH_STORE			MACRO_EEPROM_STORE
+#define MACRO_LOG_STORE				(MACRO_EEPROM_STORE + 1)
+
+#define MACRO_PAUSE					0		// report ID of pause entries
+
+static uint8_t mode;
+static uint8_t pending;					/** mode to start once the log is saved */
+static uint8_t overflow;				/** 1 = recording stopped, log or ring buffer full */
+static uint8_t ring[MACRO_BUFFER_SIZE];
+static uint8_t head;					/** next free byte in ring */
+static uint8_t tail;					/** next byte to write to EEPROM */
+static uint8_t length;					/** bytes logged (record) or position in log (replay) */
+static uint8_t written;					/** bytes written to EEPROM */
+static uint16_t delta;					/** ticks since last (record) or until next (replay) command */
+
+/**
+ *  @brief      Read delta of next entry for replay
+*/
+static void macro_read_delta(void){
+	delta = eeprom_read_byte((uint8_t *)MACRO_LOG_STORE + length++);
+}
+
+/**
+ *  @brief      Start macro mode
+ *  @param    	newmode (MACRO_STOP, MACRO_RECORD, MACRO_REPLAY_ONCE, MACRO_REPLAY_LOOP)
+*/
+static void macro_start(uint8_t newmode){
+	mode = newmode;
+	head = 0;
+	tail = 0;
+	length = 0;
+	written = 0;
+	delta = 0;
+
+	if (mode == MACRO_REPLAY_ONCE || mode == MACRO_REPLAY_LOOP) {
+		uint8_t len = eeprom_read_byte((uint8_t *)MACRO_LENGTH_STORE);
+		if (len == 0 || len > MACRO_SIZE) {		// nothing recorded
+			mode = MACRO_STOP;
+			return;
+		}
+		macro_read_delta();
+	} else if (mode == MACRO_RECORD) {
+		overflow = 0;
+	} else {
+		mode = MACRO_STOP;
+	}
+}
+
+/**
+ *  @brief      Write the ring buffer to EEPROM
+ *
+ *  Called from the main loop, writes one byte whenever the EEPROM is
+ *  ready. Once the log is complete (MACRO_SAVE) the length is saved and
+ *  the pending mode started.
+*/
+void macro_poll(void){
+	if ((mode != MACRO_RECORD && mode != MACRO_SAVE) || !eeprom_is_ready()) {
+		return;
+	}
+	if (head != tail) {
+		DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_write_byte((uint8_t *)MACRO_LOG_STORE + written++, ring[tail]));
+		tail = (tail + 1) & (MACRO_BUFFER_SIZE - 1);
+	} else if (mode == MACRO_SAVE) {
+		DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_byte((uint8_t *)MACRO_LENGTH_STORE, length));
+		macro_start(pending);
+	}
+}
+
+/**
+ *  @brief      Log bytes waiting for the EEPROM
+ *  @return		1 = macro_poll() has work to do
+*/
+uint8_t macro_busy(void){
+	return head != tail || mode == MACRO_SAVE;
+}
+
+/**
+ *  @brief      Append byte to log
+ *  @param    	value
+*/
+static void macro_put(uint8_t value){
+	ring[head] = value;
+	head = (head + 1) & (MACRO_BUFFER_SIZE - 1);
+	length++;
+}
+
+/**
+ *  @brief      Set macro mode
+ *
+ *  Leaving record mode saves the rest of the log first (MACRO_SAVE), the
+ *  new mode starts from macro_poll() when it is done.
+ *  @param    	newmode (MACRO_STOP, MACRO_RECORD, MACRO_REPLAY_ONCE, MACRO_REPLAY_LOOP)
+*/
+void macro_set_mode(uint8_t newmode){
+	if (mode == MACRO_RECORD || mode == MACRO_SAVE) {
+		mode = MACRO_SAVE;
+		pending = newmode;
+		return;
+	}
+	macro_start(newmode);
+}
+
+/**
+ *  @brief      Get macro mode
+ *  @return		mode
+*/
+uint8_t macro_get_mode(void){
+	return mode;
+}
+
+/**
+ *  @brief      Get overflow state
+ *  @return		1 = last recording stopped because the log or the ring buffer was full
+*/
+uint8_t macro_get_overflow(void){
+	return overflow;
+}
+
+/**
+ *  @brief      Stop recording on overflow
+*/
+static void macro_overflow(void){
+	overflow = 1;
+	macro_set_mode(MACRO_STOP);
+}
+
+/**
+ *  @brief      Log SET report
+ *
+ *  Recording stops when the log or the ring buffer is full.
+ *  @param    	report Report ID followed by the report data
+ *  @param    	len length of report including ID (1..8)
+*/
+void macro_record(const uint8_t *report, uint8_t len){
+	uint8_t i;
+
+	if (mode != MACRO_RECORD) {
+		return;
+	}
+
+	switch (report[0]) {						// light commands only
+		case DESKLAMP_CMD_SET_LED:
+		case DESKLAMP_CMD_SET_DIMMER:
+		case DESKLAMP_CMD_SET_RGB:
+		case DESKLAMP_CMD_SET_STROBE:
+		case DESKLAMP_CMD_SET_HSV:
+		case DESKLAMP_CMD_SET_CCT:
+		case DESKLAMP_CMD_SET_FADE:
+		case DESKLAMP_CMD_PLAY_SEQUENCE:
+		case DESKLAMP_CMD_RUN_PROGRAM:
+		case DESKLAMP_CMD_RECALL_SCENE:
+		case DESKLAMP_CMD_SET_EFFECT:
+		case DESKLAMP_CMD_SET_LFO:
+		case DESKLAMP_CMD_STROBE_BEAT:
+			break;
+
+		default:
+			return;
+	}
+
+	while (delta > 255) {
+		if (length + 3 > MACRO_SIZE || ((tail - head - 1) & (MACRO_BUFFER_SIZE - 1)) < 3) {
+			macro_overflow();
+			return;
+		}
+		macro_put(255);
+		macro_put(MACRO_PAUSE);
+		macro_put(0);
+		delta -= 255;
+	}
+
+	if (length + len + 2 > MACRO_SIZE || ((tail - head - 1) & (MACRO_BUFFER_SIZE - 1)) < len + 2) {
+		macro_overflow();
+		return;
+	}
+	macro_put(delta);
+	macro_put(report[0]);
+	macro_put(len - 1);
+	for (i = 1; i < len; i++) {
+		macro_put(report[i]);
+	}
+	delta = 0;
+}
+
+/**
+ *  @brief      Process one system tick
+*/
+void macro_tick(void){
+	switch (mode) {
+		case MACRO_RECORD:
+			if (delta < 0xFFFF) {
+				delta++;
+			}
+			break;
+
+		case MACRO_REPLAY_ONCE:
+		case MACRO_REPLAY_LOOP:
+			if (delta) {
+				delta--;
+			}
+			break;
+	}
+}
+
+/**
+ *  @brief      Get next command to replay
+ *  @param    	report buffer for report ID and data (8 bytes)
+ *  @return		1 = command due in report, 0 = nothing to do
+*/
+uint8_t macro_next(uint8_t *report){
+	uint8_t len, i;
+
+	while ((mode == MACRO_REPLAY_ONCE || mode == MACRO_REPLAY_LOOP) && delta == 0) {
+		report[0] = eeprom_read_byte((uint8_t *)MACRO_LOG_STORE + length++);
+		len = eeprom_read_byte((uint8_t *)MACRO_LOG_STORE + length++);
+		if (len > 7) {
+			len = 7;
+		}
+		for (i = 1; i <= len; i++) {
+			report[i] = eeprom_read_byte((uint8_t *)MACRO_LOG_STORE + length++);
+		}
+		for (; i < 8; i++) {
+			report[i] = 0;
+		}
+
+		if (length >= eeprom_read_byte((uint8_t *)MACRO_LENGTH_STORE)) {
+			if (mode == MACRO_REPLAY_ONCE) {
+				mode = MACRO_STOP;
+			} else {
+				length = 0;
+				macro_read_delta();
+				if (delta == 0) {				// at least one tick per loop
+					delta = 1;
+				}
+			}
+		} else {
+			macro_read_delta();
+		}
+
+		if (report[0] != MACRO_PAUSE) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#endif
+
+/* --------------------------------- End Of File ------------------------------ */
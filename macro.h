@@ -0,0 +1,42 @@
+/**
+ * @file 	macro.h
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Macro recorder for host commands
+ *
+ */
+
+#ifndef __MACRO_H
+#define __MACRO_H
+
+#include <stdint.h>
+
+/** Size of the command log in EEPROM (bytes) */
+#define MACRO_SIZE					191
+
+/** Size of the SRAM record buffer (bytes, power of 2) */
+#define MACRO_BUFFER_SIZE			32
+
+/**
+ * @name Macro modes
+ * @{
+ */
+#define MACRO_STOP					0
+#define MACRO_RECORD				1
+#define MACRO_REPLAY_ONCE			2
+#define MACRO_REPLAY_LOOP			3
+#define MACRO_SAVE					4		// recording done, log is being written to EEPROM
+/** @} */
+
+void macro_set_mode(uint8_t mode);
+uint8_t macro_get_mode(void);
+uint8_t macro_get_overflow(void);
+void macro_poll(void);
+uint8_t macro_busy(void);
+void macro_record(const uint8_t *report, uint8_t len);
+void macro_tick(void);
+uint8_t macro_next(uint8_t *report);
+
+#endif /* __MACRO_H */
+
+/* --------------------------------- End Of File ------------------------------ */
@@ -21,14 +21,22 @@
 #include <avr/signature.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <avr/wdt.h>
+#include <avr/sleep.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "usbconfig.h"
 #include "usbdrv/usbdrv.h"
 #include "desklamp.h"
+#include "entropy.h"
+#include "sequence.h"
+#include "vm.h"
+#include "macro.h"
+#include "effect.h"
+#include "lfo.h"
+#include "diag.h"
 
 FUSES = {
 	.low = 0xEE,
@@ -37,31 +45,20 @@ FUSES = {
 };
 
 static uchar buffer[8];
-static uchar currentPosition, bytesRemaining;
-
-#if STROBE == 1
-const PROGMEM uint8_t strobetable[256] = {
-		  0, 164, 149, 136, 125, 116, 108, 101,  95,  90,  85,  81,  77,  73,  70,  67,
-	 	 64,  62,  60,  57,  55,  54,  52,  50,  49,  47,  46,  44,  43,  42,  41,  40,
-		 39,  38,  37,  36,  35,  35,  34,  33,  32,  32,  31,  31,  30,  29,  29,  28,
-		 28, 27, 27, 26, 26, 26, 25, 25, 24, 24, 24, 23, 23, 23, 22, 22,
-		 22, 21, 21, 21, 20, 20, 20, 20, 19, 19, 19, 19, 18, 18, 18, 18,
-		 18, 17, 17, 17, 17, 17, 16, 16, 16, 16, 16, 16, 15, 15, 15, 15,
-		 15, 15, 15, 14, 14, 14, 14, 14, 14, 14, 14, 13, 13, 13, 13, 13,
-		 13, 13, 13, 13, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 11, 11,
-		 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 10, 10, 10, 10, 10, 10,
-		 10, 10, 10, 10, 10, 10, 10, 10, 10,  9,  9,  9,  9,  9,  9,  9,
-		 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 8, 8, 8, 8, 8,
-		 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-		 8, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-		 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 6, 6,
-		 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-		 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6
-};
+#if DIAGNOSTICS == 1
+static uchar replyBuf[1 + DIAG_REPORT_SIZE];
+#elif RESET_LOG == 1
+static uchar replyBuf[2 + 2 * DESKLAMP_RESET_CAUSES];
+#else
+static uchar replyBuf[5];
 #endif
+static uchar currentPosition, bytesRemaining;
+static uchar extended;						// 1 = drop the report ID of DESKLAMP_CMD_EXTENDED
+static uint8_t extUSB;						// 1 = external USB device uses the LED outputs
+static uint8_t lastExtUSB = 1;
 
 /** USB Descriptor */
-PROGMEM const char usbHidReportDescriptor[146] = {
+PROGMEM const char usbHidReportDescriptor[] = {
     0x05, 0x08,                    // USAGE_PAGE (LEDs)
     0x09, 0x4b,                    // USAGE (Generic Indicator)
     0xa1, 0x01,                    // COLLECTION (Application)
@@ -89,7 +86,7 @@ PROGMEM const char usbHidReportDescriptor[146] = {
     0xa1, 0x02,                    //   COLLECTION (Logical)
     0x09, 0x3e,                    //     USAGE (Indicator Flash)
     0x85, 0x04,                    //     REPORT_ID (4)
-    0x95, 0x01,                    //     REPORT_COUNT (1)
+    0x95, 0x07,                    //     REPORT_COUNT (7)
     0x91, 0x00,                    //     OUTPUT (Data,Ary,Abs)
     0xc0,                          //   END_COLLECTION
     0xa1, 0x02,                    //   COLLECTION (Logical)
@@ -140,9 +137,60 @@ PROGMEM const char usbHidReportDescriptor[146] = {
     0x95, 0x01,                    //     REPORT_COUNT (1)
     0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
     0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x0E,                    //     REPORT_ID (14)
+    0x95, 0x04,                    //     REPORT_COUNT (4)
+    0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x10,                    //     REPORT_ID (16)
+    0x95, 0x03,                    //     REPORT_COUNT (3)
+    0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x1A,                    //     REPORT_ID (26)
+    0x95, 0x02,                    //     REPORT_COUNT (2)
+    0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x1E,                    //     REPORT_ID (30)
+    0x95, 0x10,                    //     REPORT_COUNT (16)
+    0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x1F,                    //     REPORT_ID (31)
+    0x95, 0x12,                    //     REPORT_COUNT (18)
+    0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x20,                    //     REPORT_ID (32)
+    0x95, 0x06,                    //     REPORT_COUNT (6)
+    0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x21,                    //     REPORT_ID (33)
+    0x95, 0x09,                    //     REPORT_COUNT (9)
+    0xb1, 0x00,                    //     FEATURE (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
+    0xa1, 0x02,                    //   COLLECTION (Logical)
+    0x09, 0x47,                    //     USAGE (Usage Indicator Color)
+    0x85, 0x40,                    //     REPORT_ID (64)
+    0x95, 0x08,                    //     REPORT_COUNT (8)
+    0x91, 0x00,                    //     OUTPUT (Data,Ary,Abs)
+    0xc0,                          //   END_COLLECTION
     0xc0                           // END_COLLECTION
 };
 
+/* usbdrv.c announces USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH bytes, a miscount must not build */
+_Static_assert(sizeof(usbHidReportDescriptor) == USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, "USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH does not match usbHidReportDescriptor");
+
 #define SERIAL_NUMBER_LENGTH 8
 
 /* ------------------------------------------------------------------------- */
@@ -173,10 +221,20 @@ uchar usbFunctionWrite(uchar *data, uchar len) {
 		len = bytesRemaining;               // limit to the amount we can store
 	bytesRemaining -= len;
 
-	for(i = 0; i < len; i++)
+	for(i = 0; i < len; i++) {
+		if (extended) {						// the command ID follows, it takes the place of the report ID
+			extended = 0;
+			continue;
+		}
 		buffer[currentPosition++] = data[i];
+	}
 
-	desklamp_set_state(DESKLAMP_STATE_RX_DATA);
+	if (bytesRemaining == 0) {				// report 64 takes two packets, dispatch once
+		desklamp_set_state(DESKLAMP_STATE_RX_DATA);
+#if DIAGNOSTICS == 1
+		diag_command_received();
+#endif
+	}
 
 	return bytesRemaining == 0;             // return 1 if we have all data
 }
@@ -191,7 +249,6 @@ uchar usbFunctionWrite(uchar *data, uchar len) {
 * @return	The number of returned bytes (in buffer[]).
 */
 usbMsgLen_t usbFunctionSetup(uchar setupData[8]) {
-	static uchar replyBuf[4];
 	usbRequest_t *rq = (void *)setupData;   // cast to structured data for parsing
 
 	usbMsgPtr = replyBuf;
@@ -205,6 +262,29 @@ usbMsgLen_t usbFunctionSetup(uchar setupData[8]) {
                     replyBuf[3] = desklamp_get_rgb('b');
                     return 4;
 
+#if HSV == 1
+        		case DESKLAMP_CMD_GET_HSV:				/** get HSV VALUES */
+        		{
+        			uint16_t hue = desklamp_get_hsv('h');
+                    replyBuf[1] = HIGHBYTE(hue);
+                    replyBuf[2] = LOWBYTE(hue);
+                    replyBuf[3] = desklamp_get_hsv('s');
+                    replyBuf[4] = desklamp_get_hsv('v');
+                    return 5;
+        		}
+#endif
+
+#if CCT == 1
+        		case DESKLAMP_CMD_GET_CCT:				/** get color temperature */
+        		{
+        			uint16_t kelvin = desklamp_get_cct();
+                    replyBuf[1] = HIGHBYTE(kelvin);
+                    replyBuf[2] = LOWBYTE(kelvin);
+                    replyBuf[3] = desklamp_get_tint();
+                    return 4;
+        		}
+#endif
+
         		case DESKLAMP_CMD_GET_DIMMER:				/** get Dimmer value */
                     replyBuf[1] = desklamp_get_dimmer();
                     return 2;
@@ -218,12 +298,45 @@ usbMsgLen_t usbFunctionSetup(uchar setupData[8]) {
                     return 2;
 
         		case DESKLAMP_CMD_GET_EXTUSB:		/** get external USB state */
-        			if (desklamp_is_adapter()) {
+        			if (DESKLAMP_IS_ADAPTER()) {
         				replyBuf[1] = desklamp_chk_extusb();
         			} else {
         				replyBuf[1] = 0;
         			}
                     return 2;
+
+#if RESET_LOG == 1
+        		case DESKLAMP_CMD_RESETS:			/** get reset cause and counters */
+        		{
+        			uint8_t cause;
+        			uint16_t count;
+        			replyBuf[1] = desklamp_get_reset_cause();
+        			for (cause = 0; cause < DESKLAMP_RESET_CAUSES; cause++) {
+        				count = desklamp_get_reset_count(cause);
+        				replyBuf[2 + 2 * cause] = HIGHBYTE(count);
+        				replyBuf[3 + 2 * cause] = LOWBYTE(count);
+        			}
+        			return 2 + 2 * DESKLAMP_RESET_CAUSES;
+        		}
+#endif
+
+#if MACRO == 1
+        		case DESKLAMP_CMD_MACRO:			/** get macro recorder state */
+                    replyBuf[1] = macro_get_mode();
+                    replyBuf[2] = macro_get_overflow();
+                    return 3;
+#endif
+
+#if DIAGNOSTICS == 1
+        		case DESKLAMP_CMD_DIAG_LATENCY:		/** get command latency */
+        			return 1 + diag_get_latency(&replyBuf[1]);
+
+        		case DESKLAMP_CMD_DIAG_PROFILE:		/** get profiling counters */
+        			return 1 + diag_get_profile(&replyBuf[1]);
+
+        		case DESKLAMP_CMD_DIAG_STACK:		/** get free RAM and stack use */
+        			return 1 + diag_get_stack(&replyBuf[1]);
+#endif
         	}
         	return 0; // should not get here
         }else if(rq->bRequest == USBRQ_HID_SET_REPORT){
@@ -235,10 +348,16 @@ usbMsgLen_t usbFunctionSetup(uchar setupData[8]) {
         		case DESKLAMP_CMD_SET_COLORMODE:
         		case DESKLAMP_CMD_SET_ADAPTER:
         		case DESKLAMP_CMD_SET_SERIAL:
+        		case DESKLAMP_CMD_DIAG_LATENCY:
+        		case DESKLAMP_CMD_DIAG_PROFILE:
+        		case DESKLAMP_CMD_RESETS:
+        		case DESKLAMP_CMD_EXTENDED:
+        			extended = rq->wValue.bytes[0] == DESKLAMP_CMD_EXTENDED;
         			currentPosition = 0;                // initialize position index
+        			memset(buffer, 0, sizeof(buffer));  // short reports read as zero padded
         			bytesRemaining = rq->wLength.word;  // store the amount of data requested
-        			if(bytesRemaining > sizeof(buffer)) // limit to buffer size
-        				bytesRemaining = sizeof(buffer);
+        			if(bytesRemaining > sizeof(buffer) + extended) // limit to buffer size
+        				bytesRemaining = sizeof(buffer) + extended;
         			return USB_NO_MSG;        			// tell driver to use usbFunctionWrite()
         	}
             return 0;
@@ -250,9 +369,17 @@ usbMsgLen_t usbFunctionSetup(uchar setupData[8]) {
 /**
 *  @brief	USB Event Reset Ready
 *
+* A bus reset means the host is gone (unplugged driver, host reboot). The
+* failsafe only acts if a SET report was received since the last one, so
+* the reset at power-up enumeration does not trigger it. While the external
+* USB device owns the outputs the lamp is left alone.
 */
 void usbEventResetReady(void) {
-
+#if FAILSAFE == 1
+	if (!extUSB) {
+		desklamp_host_lost();
+	}
+#endif
 }
 
 uchar usbFunctionDescriptor(usbRequest_t *rq) {
@@ -275,64 +402,265 @@ uchar usbFunctionDescriptor(usbRequest_t *rq) {
 	return 0;
 }
 
+/**
+*  @brief	Execute SET command
+*
+* @param   *data	Report ID followed by the report data
+*/
+static void dispatchCommand(uchar *data) {
+	switch (data[0]) { // Report ID
+		case DESKLAMP_CMD_SET_LED:
+			desklamp_set_led_intensity(data[1], data[2]);
+			break;
+		case DESKLAMP_CMD_SET_DIMMER:
+			desklamp_set_dimmer(data[1]);
+			break;
+		case DESKLAMP_CMD_SET_RGB:
+			desklamp_set_rgb(data[1], data[2], data[3]);
+			break;
+		case DESKLAMP_CMD_SET_STROBE:
+#if STROBE == 1
+			// intensity 0 (short report of older hosts) is full intensity
+			desklamp_set_strobe_flash((uint16_t)data[4] << 8 | data[5], data[6], data[7] ? data[7] : 255);
+			if (data[2] | data[3]) {
+				desklamp_set_strobe((uint16_t)data[2] << 8 | data[3]);
+			} else {
+				desklamp_set_strobe_legacy(data[1]);
+			}
+#endif
+			break;
+		case DESKLAMP_CMD_SET_COLORMODE:
+			desklamp_set_colormode(data[1]);
+			break;
+		case DESKLAMP_CMD_SET_ADAPTER:
+			desklamp_set_adapter(data[1]);
+			break;
+		case DESKLAMP_CMD_SET_SERIAL:
+			desklamp_set_serial((uint32_t)data[1] << 24 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 8 | (uint32_t)data[4]);
+			break;
+#if HSV == 1
+		case DESKLAMP_CMD_SET_HSV:
+			desklamp_set_hsv((uint16_t)data[1] << 8 | data[2], data[3], data[4]);
+			break;
+#endif
+#if CCT == 1
+		case DESKLAMP_CMD_SET_CCT:
+			desklamp_set_cct((uint16_t)data[1] << 8 | data[2], (int8_t)data[3]);
+			break;
+#endif
+#if FADE == 1
+		case DESKLAMP_CMD_SET_FADE:
+			desklamp_fade(data[1], data[2], data[3], data[4], (uint16_t)data[5] << 8 | data[6]);
+			break;
+#endif
+#if SEQUENCE == 1
+		case DESKLAMP_CMD_SET_KEYFRAME:
+			sequence_set_keyframe(data[1], &data[2]);
+			break;
+		case DESKLAMP_CMD_PLAY_SEQUENCE:
+			sequence_play(data[1]);
+			break;
+#endif
+#if VM == 1
+		case DESKLAMP_CMD_SET_PROGRAM:
+			vm_set_program(data[1], &data[2], 6);
+			break;
+		case DESKLAMP_CMD_RUN_PROGRAM:
+			vm_run(data[1]);
+			break;
+#endif
+#if POWERON == 1
+		case DESKLAMP_CMD_SET_POWERON:
+			desklamp_set_poweron(data[1], data[2], data[3], data[4], data[5]);
+			break;
+#endif
+#if FAILSAFE == 1
+		case DESKLAMP_CMD_SET_FAILSAFE:
+			desklamp_set_failsafe(data[1], data[2], data[3], (uint16_t)data[4] << 8 | data[5]);
+			break;
+#endif
+#if EFFECTS == 1
+		case DESKLAMP_CMD_SET_EFFECT:
+			effect_set(data[1], data[2], data[3]);
+			break;
+#endif
+#if STROBE_BEAT == 1
+		case DESKLAMP_CMD_STROBE_BEAT:
+			desklamp_strobe_beat((uint16_t)data[1] << 8 | data[2], data[3]);
+			break;
+#endif
+#if LFO == 1
+		case DESKLAMP_CMD_SET_LFO:
+			lfo_set(data[1], data[2], (uint16_t)data[3] << 8 | data[4], data[5], data[6]);
+			break;
+#endif
+#if RESET_LOG == 1
+		case DESKLAMP_CMD_RESETS:
+			desklamp_clear_reset_counts();
+			break;
+#endif
+#if DIAGNOSTICS == 1
+		case DESKLAMP_CMD_DIAG_LATENCY:
+			diag_reset_latency();
+			break;
+
+		case DESKLAMP_CMD_DIAG_PROFILE:
+			diag_reset_profile();
+			break;
+#endif
+#if MACRO == 1
+		case DESKLAMP_CMD_MACRO:
+			macro_set_mode(data[1]);
+			break;
+#endif
+#if SCENE_COUNT > 0
+		case DESKLAMP_CMD_STORE_SCENE:
+			desklamp_store_scene(data[1]);
+			break;
+		case DESKLAMP_CMD_RECALL_SCENE:
+			desklamp_recall_scene(data[1], (uint16_t)data[2] << 8 | data[3]);
+			break;
+#endif
+	}
+}
+
 /* ------------------------------------------------------------------------- */
 
+/**
+*  @brief	Task: check external USB device
+*/
+static void taskExtUSB(void) {
+	if (!desklamp_extusb_changed() || !DESKLAMP_IS_ADAPTER()) {
+		return;
+	}
+	extUSB = desklamp_chk_extusb();
+	if (extUSB != lastExtUSB) {
+		if (extUSB) {
+			// Disable PWM when external device using USB data lines is connected
+			desklamp_set_led(1, ON);
+			desklamp_config_channel(1, DISABLE);
+		} else {
+			// Enable PWM
+			desklamp_init_pwm();
+		}
+		lastExtUSB = extUSB;
+	}
+}
+
+#if MACRO == 1
+/**
+*  @brief	Task: record and replay macros
+*/
+static void taskMacro(void) {
+	uchar report[8];
+
+	macro_tick();
+	while (macro_next(report)) {
+		dispatchCommand(report);
+	}
+}
+#endif
+
+/** Typdef for a scheduled task */
+typedef struct {
+	void (*run)(void);			/** task function */
+	uint8_t period;				/** ticks between runs */
+	uint8_t lamp;				/** 1 = only while the LEDs are driven */
+} task_t;
+
+/** Tasks, run in this order on the system tick */
+static const PROGMEM task_t tasks[] = {
+	{taskExtUSB,		1,						0},
+	{entropy_tick,		1,						0},
+	{desklamp_tick,		1,						1},
+#if SEQUENCE == 1
+	{sequence_tick,		1,						1},
+#endif
+#if VM == 1
+	{vm_tick,			1,						1},
+#endif
+#if EFFECTS == 1
+	{effect_tick,		1,						1},
+#endif
+#if LFO == 1
+	{lfo_tick,			1,						1},
+#endif
+#if MACRO == 1
+	{taskMacro,			1,						1},
+#endif
+#if DIAGNOSTICS == 1
+	{diag_tick,			DESKLAMP_MS_TO_TICKS(1000),	0},
+#endif
+};
+
+#define TASK_COUNT		(sizeof(tasks) / sizeof(task_t))
+
+/**
+*  @brief	Run the tasks that are due on this tick
+*/
+static void schedulerTick(void) {
+	static uint8_t due[TASK_COUNT];			// ticks until next run
+	void (*run)(void);
+	uint8_t i;
+
+	for (i = 0; i < TASK_COUNT; i++) {
+		if (due[i] > 1) {
+			due[i]--;
+			continue;
+		}
+		due[i] = pgm_read_byte(&(tasks[i].period));
+		if (!extUSB || !pgm_read_byte(&(tasks[i].lamp))) {
+			run = (void (*)(void))pgm_read_word(&(tasks[i].run));
+			run();
+		}
+	}
+}
+
 /**
 *  @brief	Main function
 */
 int main(void) {
 	uint8_t  i;
-	uint8_t lastExtUSB = 1;
-#if STROBE == 1
-	uint16_t lastStrobe = 0;
-	uint16_t count = 0;
-#endif
+	uint8_t ticks;
+
+	/* enable Watchdog, it also collects entropy (desklamp_init() needs it for the serial) */
+	entropy_init();
 
 	/* set LED-ports to output */
 	desklamp_init();
+#if DIAGNOSTICS == 1
+	diag_init();
+#endif
 
-	if (!desklamp_is_adapter()) {
-		// Enable PWM
+	if (!DESKLAMP_IS_ADAPTER() || !desklamp_chk_extusb()) {
+		// Enable PWM before the USB disconnect delay, so the power-on look is shown immediately
 		desklamp_init_pwm();
+		lastExtUSB = 0;
 	}
-
-	/* enable Watchdog */
-	wdt_enable(WDTO_1S);
+	extUSB = lastExtUSB;
 
 	/* We fake an USB disconnect by pulling D+ and D- to 0 during reset. This is
 		 * necessary if we had a watchdog reset or brownout reset to notify the host
 		 * that it should re-enumerate the device. Otherwise the host's and device's
 		 * concept of the device-ID would be out of sync.
 		 */
-	usbDeviceDisconnect();  /* enforce re-enumeration, do this while interrupts are disabled! */
+	usbDeviceDisconnect();  /* enforce re-enumeration, the USB interrupt is enabled in usbInit() only */
 	for(i = 0; i<250; i++) { 	// wait 500 ms
-		wdt_reset(); 			// keep the watchdog happy
+		entropy_wdt_reset(); 	// keep the watchdog happy
 		_delay_ms(2);
 	}
 	usbDeviceConnect();
 
 	usbInit();
+	set_sleep_mode(SLEEP_MODE_IDLE);
 	sei();
 
 	while(1){    							// main event loop
-		wdt_reset();
-		usbPoll();
-
-		uint8_t extUSB = 0;
-		if (desklamp_is_adapter()) {
-			extUSB = desklamp_chk_extusb();
-			if (extUSB != lastExtUSB) {
-				if (extUSB) {
-					// Disable PWM when external device using USB data lines is connected
-					desklamp_set_led(1, ON);
-					desklamp_config_channel(1, DISABLE);
-				} else {
-					// Enable PWM
-					desklamp_init_pwm();
-				}
-				lastExtUSB = extUSB;
-			}
-		}
+#if DIAGNOSTICS == 1
+		diag_loop_begin();
+#endif
+		entropy_wdt_reset();
+		DIAG_PROFILE(DIAG_PROFILE_USBPOLL, usbPoll());
 
 		// check ext_usb device
 		if (!extUSB) {
@@ -343,65 +671,45 @@ int main(void) {
 
 				case DESKLAMP_STATE_RX_DATA:
 					desklamp_set_state(DESKLAMP_STATE_BUSY);
-					/** Desklamp Set Commands */
-					switch (buffer[0]) { // Report ID
-						case DESKLAMP_CMD_SET_LED:
-							desklamp_set_led_intensity(buffer[1], buffer[2]);
-							break;
-						case DESKLAMP_CMD_SET_DIMMER:
-							desklamp_set_dimmer(buffer[1]);
-							break;
-						case DESKLAMP_CMD_SET_RGB:
-							desklamp_set_rgb(buffer[1], buffer[2], buffer[3]);
-							break;
-						case DESKLAMP_CMD_SET_STROBE:
-							desklamp_set_strobe(buffer[1]);
-							break;
-						case DESKLAMP_CMD_SET_COLORMODE:
-							desklamp_set_colormode(buffer[1]);
-							break;
-						case DESKLAMP_CMD_SET_ADAPTER:
-							desklamp_set_adapter(buffer[1]);
-							break;
-						case DESKLAMP_CMD_SET_SERIAL:
-							desklamp_set_serial((uint32_t)buffer[1] << 24 | (uint32_t)buffer[2] << 16 | (uint32_t)buffer[3] << 8 | (uint32_t)buffer[4]);
-							break;
-					}
+#if FAILSAFE == 1
+					desklamp_host_active();
+#endif
+#if MACRO == 1
+					macro_record(buffer, currentPosition);
+#endif
+					dispatchCommand(buffer);
 
 					desklamp_set_state(DESKLAMP_STATE_IDLE);
 					break;
 			}
+		}
 
-#if STROBE == 1
-			if(TIFR0 & (1 << TOV0)) {
-				uint16_t curStrobe = desklamp_get_strobe();
-				// Strobe off
-				if (curStrobe == 0 && lastStrobe != 0) {
-					desklamp_set_blackout(0);
-					desklamp_update_pwm();
-					lastStrobe = curStrobe;
-				} else if (curStrobe > 0) { // Strobe on [ 1,1165 ... 30,5176 Hz -> 1...255 ]
-					curStrobe = pgm_read_byte(&(strobetable[curStrobe])) - 1;
-					if (lastStrobe == 0) {
-						desklamp_set_blackout(1);
-						desklamp_update_pwm();
-						count = 0;
-					}
-					if (count == curStrobe) {
-						desklamp_set_blackout(0);
-						desklamp_update_pwm();
-					} else if (count >= curStrobe + 1) {
-						desklamp_set_blackout(1);
-						desklamp_update_pwm();
-						count = 0;
-					}
-					count++;
-					lastStrobe = curStrobe;
-				}
-				TIFR0 |= (1 << TOV0); // Reset Interrupt flag
-			}
+		// system ticks
+		for (ticks = desklamp_get_ticks(); ticks; ticks--) {
+			schedulerTick();
+		}
+#if MACRO == 1
+		macro_poll();
+#endif
+#if DIAGNOSTICS == 1
+		diag_loop_end();
+#endif
+
+		// sleep until the next interrupt (system tick or USB), unless a tick
+		// arrived meanwhile or the macro log waits for the EEPROM. sei() takes
+		// effect after sleep_cpu(), so no interrupt is missed.
+		cli();
+#if MACRO == 1
+		if (!desklamp_ticks_pending() && !macro_busy()) {
+#else
+		if (!desklamp_ticks_pending()) {
 #endif
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
 		}
+		sei();
 	}
 	return 0;
 
@@ -130,7 +130,8 @@
 #define ENTRY_JUMPER    4
 
 #if ENTRYMODE==ENTRY_ALWAYS
-  #define bootLoaderInit() {PORTA &= ~((1 << PA7) | (1 << PA6) | (1 << PA5));DDRA |= ((1 << PA7) | (1 << PA6) | (1 << PA5));}
+  // GPIOR0 hands MCUSR over to the DeskLamp firmware, micronucleus clears MCUSR
+  #define bootLoaderInit() {GPIOR0 = MCUSR;PORTA &= ~((1 << PA7) | (1 << PA6) | (1 << PA5));DDRA |= ((1 << PA7) | (1 << PA6) | (1 << PA5));}
   #define bootLoaderExit()
   #define bootLoaderStartCondition() 1
 #elif ENTRYMODE==ENTRY_WATCHDOG
@@ -0,0 +1,94 @@
+/**
+ * @file 	sequence.c
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Keyframe sequence playback
+ *
+ * Keyframes are uploaded one per report and stored in EEPROM. During
+ * playback the lamp fades from keyframe to keyframe using desklamp_fade(),
+ * so the sequence runs without any host traffic.
+ */
+
+#include <avr/eeprom.h>
+#include "desklamp.h"
+#include "sequence.h"
+#include "diag.h"
+
+#if SEQUENCE == 1
+
+#if FADE == 0
+#error "SEQUENCE requires FADE"
+#endif
+
+#define SEQUENCE_COUNT_STORE		SEQUENCE_EEPROM_STORE
+#define SEQUENCE_KEYFRAME_STORE		(SEQUENCE_EEPROM_STORE + 1)
+
+static uint8_t mode;			/** playback mode */
+static uint8_t position;		/** next keyframe */
+
+/**
+ *  @brief      Store keyframe
+ *
+ *  Keyframes have to be uploaded in order, the index of the last keyframe
+ *  uploaded defines the length of the sequence.
+ *  @param    	index (0..SEQUENCE_LENGTH - 1)
+ *  @param    	keyframe r, g, b, dimmer, fade time (ms, big-endian)
+*/
+void sequence_set_keyframe(uint8_t index, const uint8_t *keyframe){
+	if (index >= SEQUENCE_LENGTH) {
+		return;
+	}
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_block(keyframe, (uint8_t *)SEQUENCE_KEYFRAME_STORE + index * SEQUENCE_KEYFRAME_SIZE, SEQUENCE_KEYFRAME_SIZE));
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_byte((uint8_t *)SEQUENCE_COUNT_STORE, index + 1));
+}
+
+/**
+ *  @brief      Start or stop playback
+ *  @param    	newmode (SEQUENCE_STOP, SEQUENCE_ONCE, SEQUENCE_LOOP)
+*/
+void sequence_play(uint8_t newmode){
+	uint8_t count = eeprom_read_byte((uint8_t *)SEQUENCE_COUNT_STORE);
+
+	if (count == 0 || count > SEQUENCE_LENGTH) {		// no sequence stored
+		newmode = SEQUENCE_STOP;
+	}
+	mode = newmode;
+	position = 0;
+}
+
+/**
+ *  @brief      Is a sequence playing?
+ *  @return		1 = playing, 0 = stopped
+*/
+uint8_t sequence_is_playing(void){
+	return mode != SEQUENCE_STOP;
+}
+
+/**
+ *  @brief      Process one system tick
+ *
+ *  Starts the fade to the next keyframe as soon as the last one is done.
+*/
+void sequence_tick(void){
+	uint8_t keyframe[SEQUENCE_KEYFRAME_SIZE];
+
+	if (mode == SEQUENCE_STOP || desklamp_is_fading()) {
+		return;
+	}
+
+	if (position >= eeprom_read_byte((uint8_t *)SEQUENCE_COUNT_STORE)) {
+		if (mode != SEQUENCE_LOOP) {
+			mode = SEQUENCE_STOP;
+			return;
+		}
+		position = 0;
+	}
+
+	eeprom_read_block(keyframe, (uint8_t *)SEQUENCE_KEYFRAME_STORE + position * SEQUENCE_KEYFRAME_SIZE, SEQUENCE_KEYFRAME_SIZE);
+	desklamp_fade(keyframe[0], keyframe[1], keyframe[2], keyframe[3], (uint16_t)keyframe[4] << 8 | keyframe[5]);
+	position++;
+}
+
+#endif
+
+/* --------------------------------- End Of File ------------------------------ */
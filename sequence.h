@@ -0,0 +1,36 @@
+/**
+ * @file 	sequence.h
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Keyframe sequence playback
+ *
+ */
+
+#ifndef __SEQUENCE_H
+#define __SEQUENCE_H
+
+#include <stdint.h>
+
+/** Max. number of keyframes */
+#define SEQUENCE_LENGTH				16
+
+/** Size of a keyframe in EEPROM: r, g, b, dimmer, fade time (ms, big-endian) */
+#define SEQUENCE_KEYFRAME_SIZE		6
+
+/**
+ * @name Playback modes
+ * @{
+ */
+#define SEQUENCE_STOP				0
+#define SEQUENCE_ONCE				1
+#define SEQUENCE_LOOP				2
+/** @} */
+
+void sequence_set_keyframe(uint8_t index, const uint8_t *keyframe);
+void sequence_play(uint8_t mode);
+uint8_t sequence_is_playing(void);
+void sequence_tick(void);
+
+#endif /* __SEQUENCE_H */
+
+/* --------------------------------- End Of File ------------------------------ */
@@ -0,0 +1,182 @@
+/**
+ * @file 	vm.c
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Bytecode effect interpreter
+ *
+ * Small stack machine running a program from EEPROM. vm_tick() is called
+ * on every system tick and executes instructions until the program waits
+ * or VM_STEPS_PER_TICK instructions have been executed, so a program can
+ * never block usbPoll(). Any error (stack over- or underflow, unknown
+ * opcode, address outside the program) stops the program.
+ */
+
+#include <avr/eeprom.h>
+#include "desklamp.h"
+#include "entropy.h"
+#include "vm.h"
+#include "diag.h"
+
+#if VM == 1
+
+#if FADE == 0
+#error "VM requires FADE"
+#endif
+
+static uint8_t running;
+static uint8_t pc;						/** program counter */
+static uint8_t sp;						/** stack pointer, number of values on stack */
+static uint8_t stack[VM_STACK_SIZE];
+static uint16_t wait;					/** ticks to wait */
+static uint8_t fading;					/** waiting for end of fade */
+
+/**
+ *  @brief      Store program code
+ *
+ *  A running program is stopped.
+ *  @param    	offset position in program
+ *  @param    	code bytecode
+ *  @param    	len number of bytes
+*/
+void vm_set_program(uint8_t offset, const uint8_t *code, uint8_t len){
+	running = 0;
+	if (offset >= VM_PROGRAM_SIZE) {
+		return;
+	}
+	if (len > VM_PROGRAM_SIZE - offset) {
+		len = VM_PROGRAM_SIZE - offset;
+	}
+	DIAG_PROFILE(DIAG_PROFILE_EEPROM, eeprom_update_block(code, (uint8_t *)VM_EEPROM_STORE + offset, len));
+}
+
+/**
+ *  @brief      Start or stop program
+ *  @param    	run (1 = start from the beginning, 0 = stop)
+*/
+void vm_run(uint8_t run){
+	running = run ? 1 : 0;
+	pc = 0;
+	sp = 0;
+	wait = 0;
+	fading = 0;
+}
+
+/**
+ *  @brief      Is the program running?
+ *  @return		1 = running, 0 = stopped
+*/
+uint8_t vm_is_running(void){
+	return running;
+}
+
+/**
+ *  @brief      Fetch next program byte
+ *  @return		byte
+*/
+static uint8_t vm_fetch(void){
+	if (pc >= VM_PROGRAM_SIZE) {
+		running = 0;
+		return VM_OP_END;
+	}
+	return eeprom_read_byte((uint8_t *)VM_EEPROM_STORE + pc++);
+}
+
+/**
+ *  @brief      Push value to stack
+ *  @param    	value
+*/
+static void vm_push(uint8_t value){
+	if (sp >= VM_STACK_SIZE) {
+		running = 0;
+		return;
+	}
+	stack[sp++] = value;
+}
+
+/**
+ *  @brief      Pop value from stack
+ *  @return		value
+*/
+static uint8_t vm_pop(void){
+	if (sp == 0) {
+		running = 0;
+		return 0;
+	}
+	return stack[--sp];
+}
+
+/**
+ *  @brief      Process one system tick
+*/
+void vm_tick(void){
+	uint8_t steps, op, r, g, b, dimmer, n;
+	uint16_t time;
+
+	if (wait && --wait) {
+		return;
+	}
+	if (fading) {
+		if (desklamp_is_fading()) {
+			return;
+		}
+		fading = 0;
+	}
+
+	for (steps = 0; running && steps < VM_STEPS_PER_TICK; steps++) {
+		op = vm_fetch();
+		switch (op) {
+			case VM_OP_PUSH:
+				vm_push(vm_fetch());
+				break;
+
+			case VM_OP_RANDOM:
+				vm_push(((uint16_t)entropy_prng() * (vm_pop() + 1)) >> 8);
+				break;
+
+			case VM_OP_SET:
+			case VM_OP_FADE:
+				time = 0;
+				if (op == VM_OP_FADE) {
+					time = (uint16_t)vm_fetch() << 8;
+					time |= vm_fetch();
+				}
+				dimmer = vm_pop();
+				b = vm_pop();
+				g = vm_pop();
+				r = vm_pop();
+				if (!running) {
+					break;
+				}
+				desklamp_fade(r, g, b, dimmer, time);
+				fading = 1;
+				return;
+
+			case VM_OP_WAIT:
+				time = (uint16_t)vm_fetch() << 8;
+				time |= vm_fetch();
+				wait = DESKLAMP_MS_TO_TICKS(time);
+				return;
+
+			case VM_OP_LOOP:
+				op = vm_fetch();						// target address
+				n = vm_pop();
+				if (n > 1) {
+					vm_push(n - 1);
+					pc = op;
+				}
+				break;
+
+			case VM_OP_JUMP:
+				pc = vm_fetch();
+				break;
+
+			default:									// VM_OP_END, unknown opcode
+				running = 0;
+				break;
+		}
+	}
+}
+
+#endif
+
+/* --------------------------------- End Of File ------------------------------ */
@@ -0,0 +1,47 @@
+/**
+ * @file 	vm.h
+ * @date    2026/10/18
+ * @version 1.0
+ * @brief	Bytecode effect interpreter
+ *
+ */
+
+#ifndef __VM_H
+#define __VM_H
+
+#include <stdint.h>
+
+/** Program size in EEPROM (bytes) */
+#define VM_PROGRAM_SIZE				128
+
+/** Stack depth */
+#define VM_STACK_SIZE				8
+
+/** Max. instructions executed per tick */
+#define VM_STEPS_PER_TICK			16
+
+/**
+ * @name Opcodes
+ *
+ * Operands following the opcode are given in brackets, stack effects as
+ * (before -- after). Times are big-endian ms.
+ * @{
+ */
+#define VM_OP_END					0x00	// stop program
+#define VM_OP_PUSH					0x01	// [n] ( -- n)
+#define VM_OP_RANDOM				0x02	// (max -- 0..max)
+#define VM_OP_SET					0x03	// (r g b dimmer -- )
+#define VM_OP_FADE					0x04	// [time_hi time_lo] (r g b dimmer -- ) waits for end of fade
+#define VM_OP_WAIT					0x05	// [time_hi time_lo] ( -- )
+#define VM_OP_LOOP					0x06	// [addr] (n -- n-1) jump to addr while n > 1, else drop n
+#define VM_OP_JUMP					0x07	// [addr] ( -- )
+/** @} */
+
+void vm_set_program(uint8_t offset, const uint8_t *code, uint8_t len);
+void vm_run(uint8_t run);
+uint8_t vm_is_running(void);
+void vm_tick(void);
+
+#endif /* __VM_H */
+
+/* --------------------------------- End Of File ------------------------------ */